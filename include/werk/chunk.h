@@ -0,0 +1,92 @@
+#ifndef CHUNK_H
+#define CHUNK_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+/*
+ * Size of a single chunk of text, including its gap.
+ */
+#define CHUNK_SIZE 4096
+/*
+ * Maximum number of children of an inner tree node.
+ */
+#define CHUNK_FANOUT 32
+
+/*
+ * Leaf of the chunk tree: a small gap buffer. Leaves are linked in text
+ * order.
+ */
+struct chunk {
+	struct chunk *prev, *next;
+
+	size_t gap_offs, gap_size;
+	char text[CHUNK_SIZE];
+};
+
+struct chunk_node {
+	int n;
+
+	/* one extra slot, used while splitting */
+	void *child[CHUNK_FANOUT + 1];
+	/* number of bytes below each child */
+	size_t bytes[CHUNK_FANOUT + 1];
+};
+
+/*
+ * B+tree of chunks, indexed by byte offset. Moving the cursor only
+ * moves the gap within one chunk, so scattered edits in a large file
+ * never memmove more than CHUNK_SIZE bytes.
+ *
+ * Pointers returned by the ctree_*() functions are valid until the next
+ * modification of the tree.
+ */
+typedef struct chunk_tree {
+	/* a chunk if `height' is 0, a chunk_node otherwise */
+	void *root;
+	int height;
+
+	/* text length in bytes */
+	size_t len;
+
+	/* chunk found by the last lookup, and its offset */
+	struct chunk *hint;
+	size_t hint_pos;
+} ChunkTree;
+
+/*
+ * Read file `in' into a new chunk tree. Returns NULL on failure.
+ */
+ChunkTree *ctree_read(FILE *in);
+/*
+ * Free all chunks and nodes.
+ */
+void ctree_destroy(ChunkTree *ct);
+
+static inline size_t
+ctree_len(ChunkTree *ct)
+{
+	return ct->len;
+}
+
+/*
+ * Insert `len' bytes of `str' at `pos'.
+ */
+void ctree_insert(ChunkTree *ct, size_t pos, const char *str, size_t len);
+/*
+ * Delete `len' bytes at `pos'.
+ */
+void ctree_delete(ChunkTree *ct, size_t pos, size_t len);
+
+/*
+ * Pointer to byte at `pos'. The number of bytes that are contiguous from
+ * there on is stored in `run', unless it's `NULL'.
+ */
+const char *ctree_get(ChunkTree *ct, size_t pos, size_t *run);
+/*
+ * Pointer just past byte `pos - 1'. The number of bytes that are
+ * contiguous before it is stored in `run'.
+ */
+const char *ctree_get_before(ChunkTree *ct, size_t pos, size_t *run);
+
+#endif
@@ -2,6 +2,7 @@
 #define CONF_APP_H
 
 #include <werk/conf/file.h>
+#include <werk/gap.h>
 #include <werk/ui/win.h>
 
 #include <stdbool.h>
@@ -34,6 +35,13 @@ typedef struct {
 		/* newline to use in newly opened files
 		 * "\r\n" on Windows, "\n" on everything else */
 		const char *default_newline;
+		/* how to store opened files: the piece table avoids
+		 * reading large files into memory, chunks keep edits
+		 * all over large files cheap */
+		GBufStorage storage;
+		/* bytes of undo history to keep in memory, the rest
+		 * is spilled to a temporary file; 0 for no limit */
+		size_t undo_memory;
 	} text;
 } Config;
 
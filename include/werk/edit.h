@@ -4,8 +4,10 @@
 #include "conf/app.h"
 #include "conf/file.h"
 #include "gap.h"
+#include "journal.h"
 #include "lang.h"
-#include "rbtree.h"
+#include "lines.h"
+#include "marks.h"
 #include "undo.h"
 #include "ui/win.h"
 
@@ -18,40 +20,16 @@ typedef struct buffer Buffer;
 
 /* used to keep track of locations in the gap buffer */
 typedef struct {
-	/*
-	 * THERE ARE TWO TYPES OF BUFFER MARKERS: left-to-right and
-	 * right-to-left.
-	 *
-	 * The absolute offset of a marker within a buffer of size N is:
-	 *
-	 *   rtol * N + offset
-	 *
-	 * The absolute line number in a file with L lines:
-	 *
-	 *   rtol * L + line
-	 *
-	 * Right-to-left markers are considered "greater than" (>)
-	 * left-to-right markers.
-	 */
-
-	int rtol;
-
 	long offset;
 	int line, col;
 } BufferMarker;
 
 int cmp_buffer_markers(const BufferMarker *a, const BufferMarker *b);
-int cmp_buffer_markers_rbtree(struct rb_tree *tree, struct rb_node *a, struct rb_node *b);
 
-static inline ChangePos
-marker_to_change_pos(const BufferMarker *marker)
-{
-	return (ChangePos){ .offset = marker->offset, .line = marker->line, .col = marker->col };
-}
 static inline BufferMarker
-marker_from_change_pos(ChangePos pos)
+marker_from_mark(const Mark *mark)
 {
-	return (BufferMarker){ .rtol = 0, .offset = pos.offset, .line = pos.line, .col = pos.col };
+	return (BufferMarker){ .offset = mark_offset(mark), .line = mark_line(mark), .col = mark->col };
 }
 
 struct mode {
@@ -66,10 +44,56 @@ struct mode {
 	Mode *below;
 };
 
+/*
+ * Bytes between column checkpoints, see grapheme_column().
+ */
+#define COL_CHECKPOINT 512
+/*
+ * Number of lines for which column checkpoints are kept.
+ */
+#define COL_CACHE_LINES 4
+
+struct col_checkpoint {
+	/* grapheme boundary, relative to the start of the line */
+	gbuf_offs rel;
+	int col;
+};
+
+/*
+ * Columns of one line, measured at least every COL_CHECKPOINT bytes, so
+ * that grapheme_column() doesn't have to measure long lines from their
+ * start.
+ */
+struct col_cache {
+	/* start of the line, or -1 if unused */
+	gbuf_offs line_start;
+	int tab_width;
+
+	/* for evicting the least recently used line */
+	unsigned long used;
+
+	/* checkpoint `i' is at least (i + 1) * COL_CHECKPOINT bytes into
+	 * the line */
+	struct col_checkpoint *points;
+	size_t n, cap;
+};
+
+/*
+ * Selection besides the primary one, see buf_add_selection_below(). Its
+ * ends are marks, so that it moves along with the text.
+ */
+typedef struct selection {
+	Mark start, finish;
+	struct selection *next;
+} Selection;
+
 struct buffer {
 	/* Cursor is guaranteed to be at grapheme boundaries */
 	GapBuf gbuf;
 
+	/* Line lengths of `gbuf', see buf_lines_changed() */
+	LineIndex line_idx;
+
 	/* Viewport top left */
 	gbuf_offs vp_first_line;       /* first char in first line in viewport */
 	int vp_orig_line, vp_orig_col; /* first viewport line, column */
@@ -77,23 +101,37 @@ struct buffer {
 	/* Selection markers */
 	BufferMarker sel_start, sel_finish;
 
-	BufferMarker buf_start, buf_end;
+	/*
+	 * Further selections, in reverse text order. Moving the cursor,
+	 * inserting and deleting apply to all selections at once.
+	 */
+	Selection *sels;
 
 	/*
-	 * Markers that come before the "high marker" (greatest of
-	 * sel_start and sel_finish) are in lo_markers, the remaining
-	 * in hi_markers.
-	 *
-	 * sel_start and sel_finish themselves are never in either.
-	 *
-	 * The high markers are all right-to-left, the low markers all
-	 * left-to-right.
+	 * Marks that move along with the text, such as the start and end
+	 * of the buffer. Their `col' is kept up to date by
+	 * buf_lines_changed().
 	 */
-	struct rb_tree *lo_markers, *hi_markers;
+	MarkTree marks;
+	Mark buf_start, buf_end;
 
-	/* number of lines in buffer */
+	/*
+	 * Nesting depth of buf_begin_batch(). While batching, the `col' of
+	 * the marks from `batch_from' up to the end of the line of
+	 * `batch_until' is out of date (`batch_from' is -1 if no mark is),
+	 * and buf_commit() only sets `batch_commit'.
+	 */
+	int batch;
+	gbuf_offs batch_from, batch_until;
+	bool batch_commit;
+
+	/* number of lines in buffer (cached from line_idx) */
 	int lines;
 
+	/* see grapheme_column() */
+	struct col_cache col_cache[COL_CACHE_LINES];
+	unsigned long col_cache_clock;
+
 	/* Buffer-specific newline character */
 	const char *eol;
 	size_t eol_size;
@@ -106,6 +144,9 @@ struct buffer {
 
 	UndoTree *present;
 
+	/* unsaved changes, for recovery after a crash */
+	Journal journal;
+
 	struct {
 		bool active;
 		int w; /* width */
@@ -130,6 +171,7 @@ int grapheme_width(const char *str, size_t n, int col, int tab_width);
 int grapheme_column(Buffer *buf, gbuf_offs ofs);
 
 gbuf_offs marker_offs(Buffer *buf, const BufferMarker *marker);
+int marker_line(Buffer *buf, const BufferMarker *marker);
 
 /*
  * Moves `marker' to next grapheme, stores the current grapheme in `str'
@@ -142,6 +184,10 @@ int marker_next(Buffer *buf, const char **str, size_t *size, BufferMarker *marke
  */
 int marker_prev(Buffer *buf, const char **str, size_t *size, BufferMarker *marker);
 
+/*
+ * Move `marker' to start of given line (clamped to the buffer).
+ */
+void marker_goto_line(Buffer *buf, BufferMarker *marker, int line);
 /*
  * Move `marker' to start of next line.
  */
@@ -175,6 +221,16 @@ void marker_sort_pair(BufferMarker *a,
  */
 void buf_set_sel(Buffer *buf, const BufferMarker *start, const BufferMarker *finish);
 
+/*
+ * Keep the primary selection as an extra one, and make the primary
+ * selection a cursor on the next line, in the same column if possible.
+ */
+void buf_add_selection_below(Buffer *buf);
+/*
+ * Drop all but the primary selection.
+ */
+void buf_clear_selections(Buffer *buf);
+
 /*
  * Pipe buffer selection through command `str'.
  * See also: gbuf_pipe()
@@ -188,10 +244,10 @@ void buf_pipe_selection(Buffer *buf, const char *str);
 BufferMarker *buf_high_selection(Buffer *buf);
 
 /*
- * Insert string at end of selection. Moves end of selection forwards
- * accordingly.
+ * Insert string at end of every selection. Moves end of selection
+ * forwards accordingly.
  *
- * Requires a degenerate selection.
+ * Selections that aren't degenerate are left alone.
  *
  * buf_insert_input_string() Replaces tabs with spaces if so configured.
  * buf_insert_text()         Does not.
@@ -199,15 +255,42 @@ BufferMarker *buf_high_selection(Buffer *buf);
 void buf_insert_input_string(Buffer *buf, const char *input, size_t len);
 void buf_insert_text(Buffer *buf, const char *input, size_t len);
 
+/*
+ * Delete the text of every selection.
+ */
 void buf_delete_selection(Buffer *buf);
 
 void buf_commit(Buffer *buf);
 void buf_undo(Buffer *buf);
 void buf_dumb_redo(Buffer *buf);
+/*
+ * Undo or redo `steps' commits at once. The text only goes through the
+ * net difference, see undo_tree_goto().
+ */
+void buf_undo_steps(Buffer *buf, int steps);
+void buf_redo_steps(Buffer *buf, int steps);
+/*
+ * Put the text back in the state it was in at `when', see
+ * undo_tree_at_time().
+ */
+void buf_goto_time(Buffer *buf, time_t when);
+
+/*
+ * Group many edits, such as those of every selection or of an undo.
+ * Until the matching buf_end_batch(), the columns of the marks aren't
+ * kept up to date after each edit, and buf_commit() waits, so that all
+ * edits become a single undo step. buf_end_batch() then fixes up the
+ * columns in one pass over the marks that moved. Batches nest.
+ *
+ * The text, the line index and the offsets and lines of the marks are
+ * still updated right away, since every edit is placed by them.
+ */
+void buf_begin_batch(Buffer *buf);
+void buf_end_batch(Buffer *buf);
 
 /*
- * Move cursor by `delta' graphemes. Positive `delta' means movement
- * to the right, negative to the left.
+ * Move cursor of every selection by `delta' graphemes. Positive
+ * `delta' means movement to the right, negative to the left.
  */
 void buf_move_cursor(Buffer *buf, int delta, bool extend);
 
@@ -1,6 +1,11 @@
 #ifndef GAP_H
 #define GAP_H
 
+#include "chunk.h"
+#include "mgap.h"
+#include "piece.h"
+#include <stdbool.h>
+#include <unigbrk.h>
 #include <stdio.h>
 #include <stddef.h>
 
@@ -12,14 +17,84 @@ typedef int gbuf_offs;
 
 typedef struct gap_buf GapBuf;
 
+/*
+ * How a gap buffer sizes and allocates its memory.
+ */
+typedef struct gbuf_policy {
+	/*
+	 * Size for a buffer of `prev' bytes that must hold `req' bytes.
+	 * new_size(0, 0) is the initial size.
+	 */
+	size_t (*new_size)(size_t prev, size_t req);
+
+	/* buffers of this many bytes or more are mapped, so growing them
+	 * doesn't copy; 0 never maps */
+	size_t map_min;
+	/* mapped buffers of this many bytes or more ask for huge pages;
+	 * 0 never does */
+	size_t huge_min;
+} GBufPolicy;
+
+/*
+ * Grows by half at a time and shrinks only once less than a quarter is
+ * used, so resizing takes amortized constant time per byte. Buffers are
+ * mapped from 1 MiB and use huge pages from 32 MiB.
+ */
+extern const GBufPolicy gbuf_default_policy;
+
 struct gap_buf {
 	char *start;
 	size_t size;
 
+	const GBufPolicy *policy;
+	/* `start' comes from mmap() rather than malloc() */
+	bool mapped;
+
 	size_t gap_size;
 	gbuf_offs gap_offs;
+
+	/* if any is not NULL, the text lives there instead */
+	PieceTable *pt;
+	ChunkTree *ct;
+	MultiGap *mg;
+
+	/* graphemes spanning two runs of text are copied here */
+	char graph[32];
 };
 
+/*
+ * Contiguous stretch of buffer text.
+ */
+typedef struct gbuf_span {
+	const char *text;
+	size_t len;
+} GBufSpan;
+
+/*
+ * Iterates over the spans covering a range of text. A gap buffer has at
+ * most two of them, one on either side of the gap; piece table and chunk
+ * storage have one per piece or chunk, multi-gap storage one more than
+ * the number of gaps.
+ */
+typedef struct gbuf_span_iter {
+	GapBuf *buf;
+	gbuf_offs offs, stop;
+} GBufSpanIter;
+
+/*
+ * How gbuf_read() stores the file.
+ */
+typedef enum gbuf_storage {
+	/* read file into the gap buffer */
+	GBUF_STORAGE_GAP,
+	/* map file and edit it through a piece table */
+	GBUF_STORAGE_PIECE,
+	/* read file into a tree of small gap buffers */
+	GBUF_STORAGE_CHUNK,
+	/* read file into a gap buffer with a gap per edit site */
+	GBUF_STORAGE_GAPS,
+} GBufStorage;
+
 /*
  * Initialize empty gap buffer.
  */
@@ -28,12 +103,22 @@ void gbuf_init(GapBuf *buf);
  * Destroy gap buffer.
  */
 void gbuf_destroy(GapBuf *buf);
+/*
+ * Use `policy' from the next resize on.
+ */
+void gbuf_set_policy(GapBuf *buf, const GBufPolicy *policy);
 
 /*
  * Buffer length in bytes.
  */
 static inline size_t gbuf_len(GapBuf *buf)
 {
+	if (buf->pt)
+		return ptab_len(buf->pt);
+	if (buf->ct)
+		return ctree_len(buf->ct);
+	if (buf->mg)
+		return mgap_len(buf->mg);
 	return buf->size - buf->gap_size;
 }
 
@@ -46,9 +131,10 @@ void gbuf_clear(GapBuf *gbuf);
  */
 void gbuf_write(GapBuf *gbuf, FILE *out);
 /*
- * Read file `in' to gap buffer.
+ * Read file `in' to gap buffer, replacing its contents. The text is not
+ * checked to be UTF-8, lidx_rebuild() does that while counting lines.
  */
-int gbuf_read(GapBuf *gbuf, FILE *in);
+int gbuf_read(GapBuf *gbuf, FILE *in, GBufStorage storage);
 
 /*
  * Insert given text at location `cursor'.
@@ -71,6 +157,22 @@ void gbuf_delete_text(GapBuf *buf, gbuf_offs cursor, size_t len);
  * Get byte at logical offset 'offset'
  */
 const char *gbuf_get(GapBuf *buf, gbuf_offs offset);
+/*
+ * Get text at logical offset `offset', and store how many bytes are
+ * contiguous from there on in `len'.
+ */
+const char *gbuf_get_run(GapBuf *buf, gbuf_offs offset, size_t *len);
+
+/*
+ * Start iterating over the spans covering `len' bytes at `offset'. The
+ * buffer may not be modified until iteration is done.
+ */
+void gbuf_spans(GBufSpanIter *it, GapBuf *buf, gbuf_offs offset, size_t len);
+/*
+ * Store the next span in `span'. Returns false when the range has been
+ * covered.
+ */
+bool gbuf_span_next(GBufSpanIter *it, GBufSpan *span);
 
 /*
  * Moves `marker' to next grapheme, stores the current grapheme in `str'
@@ -83,6 +185,40 @@ int gbuf_grapheme_next(GapBuf *buf, const char **str, size_t *size, gbuf_offs *o
  */
 int gbuf_grapheme_prev(GapBuf *buf, const char **str, size_t *size, gbuf_offs *offset);
 
+/*
+ * Like u8_grapheme_next(), but without the call into libunistring for
+ * ASCII text. Two ASCII characters are always separate graphemes, unless
+ * they are CR LF.
+ */
+static inline const char *
+grapheme_next_fast(const char *s, const char *end)
+{
+	if (s != end && !(s[0] & 0x80)) {
+		if (s + 1 == end)
+			return end;
+		if (!(s[1] & 0x80) && !(s[0] == '\r' && s[1] == '\n'))
+			return s + 1;
+	}
+
+	return u8_grapheme_next(s, end);
+}
+
+/*
+ * Like u8_grapheme_prev(), see grapheme_next_fast().
+ */
+static inline const char *
+grapheme_prev_fast(const char *s, const char *start)
+{
+	if (s != start && !(s[-1] & 0x80)) {
+		if (s - 1 == start)
+			return start;
+		if (!(s[-2] & 0x80) && !(s[-2] == '\r' && s[-1] == '\n'))
+			return s - 1;
+	}
+
+	return u8_grapheme_prev(s, start);
+}
+
 /*
  * Copy excerpt from gap buffer to `dest'.
  */
@@ -107,7 +243,10 @@ int gbuf_resize(GapBuf *buf, size_t req);
  */
 int gbuf_auto_resize(GapBuf *buf);
 /*
- * Pipe given buffer text through command, using given environmnt.
+ * Pipe given buffer text through command, using given environmnt. The
+ * text is written while the output is read, so any amount can be piped;
+ * what the command writes to stderr is passed on to ours. If piping
+ * fails, the text is left as it was and -1 is returned.
  */
 int gbuf_pipe_e(GapBuf *buf,
                 const char *cmd,
@@ -0,0 +1,99 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "undo.h"
+
+/*
+ * What a file looks like from the outside: if any of it changes, the
+ * file was most likely written to. Used to tell whether the journal
+ * and the undo history still apply to a file.
+ */
+typedef struct file_stamp {
+	/* -1 if the file doesn't exist */
+	int64_t size;
+	int64_t mtime, mtime_nsec;
+	int64_t ctime, ctime_nsec;
+	uint64_t ino;
+} FileStamp;
+
+/*
+ * Append-only log of the changes made to a file since it was last saved,
+ * so that they survive a crash. It lives next to the file, as
+ * `.NAME.werk-journal', and starts with the size, inode and times of the
+ * file it applies to. Changes are appended in groups, one per undo step;
+ * each group is written at once, with its length and a checksum, so that
+ * a group torn by a crash is recognized and dropped.
+ *
+ * Writing a group doesn't wait for the disk; journal_sync() does, and is
+ * meant to be called periodically, so that the cost of durability
+ * depends on how much is edited, not on the size of the file.
+ */
+typedef struct journal {
+	/* -1 while there is no journal */
+	int fd;
+	char *path;
+
+	/* changes of the group being built, see journal.c */
+	char *group;
+	size_t group_len, group_size;
+
+	/* groups were written since the last journal_sync() */
+	bool unsynced;
+} Journal;
+
+void journal_init(Journal *j);
+
+/*
+ * Start journaling changes to `filename'. If its journal applies to the
+ * file as it is now, the changes in it are made again through `adder'
+ * and `deleter' (which gets a NULL copy buffer), and `end_group' is
+ * called after each group. Any other journal is replaced. Returns -1 if
+ * no journal can be kept, in which case the others are no-ops.
+ */
+int journal_open(Journal *j, const char *filename,
+                 text_adder adder, text_deleter deleter,
+                 void (*end_group)(void *udata), void *udata);
+/*
+ * Stop journaling and remove the journal, as its changes are no longer
+ * needed.
+ */
+void journal_close(Journal *j);
+
+/*
+ * Add an insertion of `len' bytes at `offset' to the group. Returns
+ * where the inserted text must be copied to, or NULL if there is no
+ * journal.
+ */
+char *journal_add(Journal *j, long offset, size_t len);
+/*
+ * Add a deletion of `len' bytes at `offset' to the group.
+ */
+void journal_delete(Journal *j, long offset, size_t len);
+/*
+ * Write the group to the journal.
+ */
+void journal_commit(Journal *j);
+
+/*
+ * Wait until the groups written so far are on disk.
+ */
+void journal_sync(Journal *j);
+/*
+ * Empty the journal, after `filename' was saved.
+ */
+void journal_reset(Journal *j, const char *filename);
+
+/*
+ * Path of the file that goes with `filename' in the same directory:
+ * `.NAME' followed by `suffix'. The result must be freed.
+ */
+char *sidecar_path(const char *filename, const char *suffix);
+/*
+ * Stamp of `filename' as it is now.
+ */
+FileStamp file_stamp(const char *filename);
+
+#endif
@@ -0,0 +1,117 @@
+#ifndef LINES_H
+#define LINES_H
+
+#include "gap.h"
+#include <stdbool.h>
+
+/*
+ * Number of line lengths stored in a single index node.
+ */
+#define LIDX_BLOCK 64
+
+struct lidx_node {
+	struct lidx_node *link[2];
+	unsigned prio;
+
+	/* number of lines in this node, and their total size in bytes */
+	int n;
+	long bytes;
+
+	/* the same, but including both subtrees */
+	int sub_lines;
+	long sub_bytes;
+
+	/* size of each line, including its newline */
+	gbuf_offs len[LIDX_BLOCK];
+};
+
+/*
+ * Balanced tree (treap) of line lengths, used to map line numbers to
+ * offsets and back in logarithmic time.
+ *
+ * There is always at least one line. Only the last line has no
+ * terminating newline (and is the only line that may be empty).
+ */
+typedef struct line_index {
+	struct lidx_node *root;
+
+	/* unused nodes, linked through link[0] */
+	struct lidx_node *pool;
+	int pool_size;
+} LineIndex;
+
+/*
+ * What lidx_rebuild() finds out about the text on the way.
+ */
+typedef struct lidx_stats {
+	/* all text is ASCII */
+	bool ascii;
+	/* most common newline sequence, or NULL if there are none */
+	const char *eol;
+	/* the last line is all printable ASCII, so its width in columns
+	 * is its length in bytes */
+	bool plain_last_line;
+} LidxStats;
+
+/*
+ * Initialize index of an empty buffer.
+ */
+void lidx_init(LineIndex *idx);
+/*
+ * Destroy line index.
+ */
+void lidx_destroy(LineIndex *idx);
+
+/*
+ * Number of lines in the buffer.
+ */
+static inline int lidx_lines(LineIndex *idx)
+{
+	return idx->root->sub_lines;
+}
+
+/*
+ * Throw away the index and recount all lines in `gbuf'. The text is
+ * checked to be valid UTF-8 in the same pass: returns -1 if it isn't,
+ * leaving the index untouched. Unless `stats' is NULL, it is filled in
+ * as well.
+ *
+ * Runs of text (see gbuf_get_run()) shouldn't split UTF-8 sequences,
+ * which holds right after gbuf_read().
+ */
+int lidx_rebuild(LineIndex *idx, GapBuf *gbuf, LidxStats *stats);
+
+/*
+ * Update index after `removed' bytes at `offs' were replaced by `added'
+ * bytes. `gbuf' should already contain the new text. Both ends of the
+ * replaced text should be grapheme boundaries.
+ *
+ * Only the inserted text and the bytes directly around it are scanned.
+ */
+void lidx_update(LineIndex *idx, GapBuf *gbuf, gbuf_offs offs, size_t removed, size_t added);
+
+/*
+ * Offset of first character in `line' (1-based). Lines past the end of
+ * the buffer are clamped.
+ */
+gbuf_offs lidx_line_start(LineIndex *idx, int line);
+/*
+ * Offset of the newline terminating `line', or the end of the buffer
+ * for the last line.
+ */
+gbuf_offs lidx_line_end(LineIndex *idx, GapBuf *gbuf, int line);
+/*
+ * Line (1-based) containing the character at `offs'. The start of the
+ * line is stored in `line_start' unless it is `NULL'.
+ */
+int lidx_line_of(LineIndex *idx, gbuf_offs offs, gbuf_offs *line_start);
+
+/*
+ * Size of the newline sequence starting at `offs', or 0 if there is
+ * none. Unlike grapheme_is_newline() this looks at bytes, not graphemes,
+ * but the two agree for valid UTF-8 (newlines never combine with
+ * anything but CR LF).
+ */
+size_t lidx_newline_size(GapBuf *gbuf, gbuf_offs offs);
+
+#endif
@@ -0,0 +1,79 @@
+#ifndef MARKS_H
+#define MARKS_H
+
+#include <stdbool.h>
+
+/*
+ * Position in the text which moves along with edits. Marks are embedded
+ * in whatever owns them and linked into a MarkTree.
+ */
+typedef struct mark {
+	struct mark *link[2], *parent;
+	unsigned prio;
+
+	/* relative to the parent mark; absolute for the root */
+	long offset;
+	int line;
+
+	/* all marks below this one are at the same position as this
+	 * one, whatever their own `offset' and `line' say */
+	bool collapsed;
+
+	/* not maintained by the tree */
+	int col;
+
+	/* text inserted right at the mark goes before it, instead of
+	 * after it */
+	bool right_gravity;
+} Mark;
+
+/*
+ * Treap of marks, ordered by offset. Each mark stores its offset and
+ * line relative to its parent, so shifting all marks after an edit only
+ * touches the marks on a single path down the tree. Marks in deleted
+ * text are split off and collapsed all at once, so edits take
+ * logarithmic time however many marks they move.
+ *
+ * The tree allocates nothing.
+ */
+typedef struct mark_tree {
+	Mark *root;
+} MarkTree;
+
+/*
+ * Initialize empty tree.
+ */
+void mtree_init(MarkTree *t);
+
+/*
+ * Add `m' at `offset', on `line'.
+ */
+void mtree_insert(MarkTree *t, Mark *m, long offset, int line);
+/*
+ * Remove `m' from the tree.
+ */
+void mtree_remove(MarkTree *t, Mark *m);
+
+/*
+ * Update marks after `removed' bytes at `offset' were replaced by
+ * `added' bytes, which changed the number of lines by `dlines'. Marks
+ * within the removed text move to `offset', which is on `line'.
+ */
+void mtree_edit(MarkTree *t, long offset, long removed, long added, int dlines, int line);
+
+/*
+ * First mark at or after `offset', or NULL.
+ */
+Mark *mtree_first_from(MarkTree *t, long offset);
+/*
+ * Next mark in text order, or NULL.
+ */
+Mark *mark_next(Mark *m);
+
+/*
+ * Absolute position of `m'.
+ */
+long mark_offset(const Mark *m);
+int mark_line(const Mark *m);
+
+#endif
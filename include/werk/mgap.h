@@ -0,0 +1,84 @@
+#ifndef MGAP_H
+#define MGAP_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+/*
+ * Maximum number of gaps in the text.
+ */
+#define MGAP_MAX 4
+/*
+ * Edits this close to a gap move it there, instead of opening a new gap.
+ */
+#define MGAP_NEAR 4096
+/*
+ * Least number of bytes of room added to a gap that is too small for an
+ * insertion; larger buffers grow by half their size.
+ */
+#define MGAP_GROW 4096
+
+/*
+ * Gap at logical offset `offs', `size' bytes long.
+ */
+struct mgap {
+	size_t offs, size;
+};
+
+/*
+ * Gap buffer with a few gaps, so that editing at several distant places
+ * in turn doesn't move the text in between back and forth. An edit far
+ * from all gaps opens a new gap there with half the room of the nearest
+ * one; once all gaps are in use, the nearest gap moves instead.
+ *
+ * Pointers returned by the mgap_*() functions are valid until the next
+ * modification of the buffer.
+ */
+typedef struct multi_gap {
+	char *text;
+	size_t size;
+
+	/* text length in bytes */
+	size_t len;
+
+	/* sorted by offset, no two at the same offset, none empty */
+	struct mgap gap[MGAP_MAX];
+	int ngaps;
+} MultiGap;
+
+/*
+ * Read file `in' into a new multi-gap buffer. Returns NULL on failure.
+ */
+MultiGap *mgap_read(FILE *in);
+/*
+ * Free the buffer.
+ */
+void mgap_destroy(MultiGap *mg);
+
+static inline size_t
+mgap_len(MultiGap *mg)
+{
+	return mg->len;
+}
+
+/*
+ * Insert `len' bytes of `str' at `pos'.
+ */
+void mgap_insert(MultiGap *mg, size_t pos, const char *str, size_t len);
+/*
+ * Delete `len' bytes at `pos'.
+ */
+void mgap_delete(MultiGap *mg, size_t pos, size_t len);
+
+/*
+ * Pointer to byte at `pos'. The number of bytes that are contiguous from
+ * there on is stored in `run', unless it's `NULL'.
+ */
+const char *mgap_get(MultiGap *mg, size_t pos, size_t *run);
+/*
+ * Pointer just past byte `pos - 1'. The number of bytes that are
+ * contiguous before it is stored in `run'.
+ */
+const char *mgap_get_before(MultiGap *mg, size_t pos, size_t *run);
+
+#endif
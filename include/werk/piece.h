@@ -0,0 +1,90 @@
+#ifndef PIECE_H
+#define PIECE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+/*
+ * Stretch of text, taken either from the original file or from the
+ * add buffer.
+ */
+typedef struct piece {
+	struct piece *link[2];
+	unsigned prio;
+
+	bool add;
+
+	/* location in the original file or add buffer */
+	size_t offs;
+	size_t len;
+
+	/* the same as `len', but including both subtrees */
+	size_t sub_len;
+} Piece;
+
+typedef struct piece_table PieceTable;
+
+/*
+ * Piece table: the original file stays mapped read-only, and all
+ * inserted text is appended to the add buffer. The text is described
+ * by a balanced tree (treap) of pieces in text order, so that edits
+ * and lookups take logarithmic time in the number of pieces.
+ *
+ * Pointers returned by the ptab_*() functions are valid until the next
+ * modification of the table.
+ */
+struct piece_table {
+	const char *orig;
+	size_t orig_size;
+
+	char *add;
+	size_t add_len, add_cap;
+
+	Piece *root;
+
+	/* text length in bytes */
+	size_t len;
+
+	/* piece found by the last lookup or touched by the last edit, and
+	 * its logical offset; NULL if there is none */
+	Piece *hint;
+	size_t hint_pos;
+};
+
+/*
+ * Map file `in' into a new piece table. Returns NULL on failure.
+ */
+PieceTable *ptab_open(FILE *in);
+/*
+ * Unmap file and free all resources.
+ */
+void ptab_destroy(PieceTable *pt);
+
+static inline size_t
+ptab_len(PieceTable *pt)
+{
+	return pt->len;
+}
+
+/*
+ * Insert `len' bytes of `str' at `pos'.
+ */
+void ptab_insert(PieceTable *pt, size_t pos, const char *str, size_t len);
+/*
+ * Delete `len' bytes at `pos'.
+ */
+void ptab_delete(PieceTable *pt, size_t pos, size_t len);
+
+/*
+ * Pointer to byte at `pos'. The number of bytes that are contiguous from
+ * there on is stored in `run', unless it's `NULL'.
+ */
+const char *ptab_get(PieceTable *pt, size_t pos, size_t *run);
+/*
+ * Pointer just past byte `pos - 1'. The number of bytes that are
+ * contiguous before it is stored in `run'.
+ */
+const char *ptab_get_before(PieceTable *pt, size_t pos, size_t *run);
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stddef.h>
+
+/*
+ * Byte scanners used when loading files. Each has an SSE2, an AVX2 and a
+ * plain C version; the best one the CPU supports is picked on first use.
+ */
+
+/*
+ * Number of leading bytes of `s' that are ASCII.
+ */
+size_t scan_ascii(const char *s, size_t len);
+/*
+ * Number of leading bytes of `s' that are printable ASCII, which is one
+ * column wide. Tabs and control characters are not printable.
+ */
+size_t scan_printable(const char *s, size_t len);
+/*
+ * Offset of the first byte in `s' that may start a newline: \n, \v, \f,
+ * \r, or the lead byte of U+0085, U+2028 or U+2029. Returns `len' if
+ * there is none.
+ */
+size_t scan_newline(const char *s, size_t len);
+
+#endif
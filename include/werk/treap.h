@@ -0,0 +1,19 @@
+#ifndef TREAP_H
+#define TREAP_H
+
+/*
+ * Priority of a new treap node. Xorshift; treap priorities only need
+ * to be vaguely random, and each file that includes this has its own
+ * sequence.
+ */
+static inline unsigned
+next_prio(void)
+{
+	static unsigned state = 2463534242u;
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+	return state;
+}
+
+#endif
@@ -82,6 +82,8 @@ struct window {
 	void (*on_delete_press)(Window *win, KeyMods mods);
 	void (*on_focus_change)(Window *win, bool focus);
 	void (*on_close)(Window *win);
+	/* called about once a second */
+	void (*on_tick)(Window *win);
 
 	void (*get_size)(Window *win, int *w, int *h);
 	void (*set_size)(Window *win, int w, int h);
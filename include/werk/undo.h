@@ -1,24 +1,29 @@
 #ifndef UNDO_H
 #define UNDO_H
 
+#include <stdbool.h>
 #include <stddef.h>
+#include <time.h>
 
-/* Significant overlap with BufferMarker */
-typedef struct {
-	long offset;
-	int line, col;
-} ChangePos;
+/*
+ * Called to insert `len' bytes of `text' at `offset'.
+ */
+typedef void (*text_adder)(long offset, const char *text, size_t len, void *udata);
+/*
+ * Called to delete `len' bytes at `offset', after copying them to
+ * `copy_deleted_text_here', unless that is NULL.
+ */
+typedef void (*text_deleter)(long offset, size_t len, char *copy_deleted_text_here, void *udata);
+/*
+ * Called to copy `len' bytes at `offset' to `copy_here'.
+ */
+typedef void (*text_reader)(long offset, size_t len, char *copy_here, void *udata);
 
-typedef struct change {
-	struct change *next;
-
-	ChangePos from, until;
-	/* Text is to be deleted if `text == NULL' */
-	const char *text;
-} Change;
-
-typedef void (*text_adder)(ChangePos from, ChangePos until, const char *text, void *udata);
-typedef void (*text_deleter)(ChangePos from, ChangePos until, char *copy_deleted_text_here, void *udata);
+/*
+ * Memory for the nodes, changes and texts of one undo tree, see
+ * undo.c. Everything is freed at once by undo_tree_destroy().
+ */
+typedef struct undo_arena UndoArena;
 
 typedef struct undo_tree {
 	struct undo_tree *past;
@@ -27,19 +32,83 @@ typedef struct undo_tree {
 	struct undo_tree *futures;
 	struct undo_tree *next_future; /* next tree sibling */
 
-	/* acts as a staging area until changes are commited */
-	Change *changes;
+	/*
+	 * Records of the changes, most recent first; acts as a staging
+	 * area until changes are commited. Each record is a varint with
+	 * the length of the change shifted left once, the low bit set if
+	 * the deleted text follows; then the zigzag varint of its offset
+	 * minus that of the next record's change (or zero). Insertions
+	 * store no text; lines and columns are looked up when undoing.
+	 */
+	unsigned char *changes;
+	size_t size;
+	/* bytes available to the records, which end at `changes + size' */
+	size_t cap;
+	/* offset of the first change */
+	long from;
+	/* when the node was committed; 0 for the root and the present */
+	time_t committed;
+	/* offset of a copy of the records in the spill file, or -1 if
+	 * there is none; if `changes' is NULL, it is the only copy */
+	long spilled_at;
+	/* number of the node in the history file, -1 if it isn't in
+	 * it, and whether the file has its current records */
+	long saved_as;
+	bool saved;
+
+	/* shared by all nodes of the tree */
+	UndoArena *arena;
 } UndoTree;
 
-UndoTree *undo_tree_init(void);
+/*
+ * New tree, which keeps about `budget' bytes of changes in memory and
+ * spills the rest to a temporary file; no limit if `budget' is 0.
+ */
+UndoTree *undo_tree_init(size_t budget);
 void undo_tree_destroy(UndoTree *present);
 
-void notify_add(UndoTree *present, ChangePos from, ChangePos until);
-void notify_delete(UndoTree *present, ChangePos from, ChangePos until, const char *text);
+/*
+ * Write the whole tree to the file `path', along with `key', which
+ * identifies the text the present applies to. Fails if the present has
+ * changes that aren't committed.
+ */
+int undo_tree_save(UndoTree *present, const char *path, const void *key, size_t key_len);
+/*
+ * Tree saved to `path' with the same `key', or NULL if there is none.
+ * The file is mapped into memory; the records of each node are read
+ * only once it is undone or redone.
+ */
+UndoTree *undo_tree_load(const char *path, const void *key, size_t key_len, size_t budget);
+
+void notify_add(UndoTree *present, long from, long until);
+void notify_delete(UndoTree *present, long from, long until, const char *text);
 
 void commit(UndoTree **present);
 
-void undo(UndoTree *present, text_adder adder, text_deleter deleter, void *udata);
-void redo(UndoTree *present, UndoTree *go_here, text_adder adder, text_deleter deleter, void *udata);
+/*
+ * Undo the last commit, or redo `go_here', a future of the present's
+ * past, in a text of `text_len' bytes. Nothing changes if the records
+ * can't be read or don't fit in the text.
+ */
+void undo(UndoTree *present, size_t text_len, text_adder adder, text_deleter deleter, void *udata);
+void redo(UndoTree *present, UndoTree *go_here, size_t text_len,
+          text_adder adder, text_deleter deleter, void *udata);
+
+/*
+ * Undo and redo the nodes between the present and `target', anywhere in
+ * the tree. Their changes are combined first, so that the text only
+ * sees the difference between both states, through `adder' and
+ * `deleter'. `reader' supplies the text that the changes on the way
+ * delete. As with undo(), nothing changes unless all nodes on the way
+ * can be used.
+ */
+void undo_tree_goto(UndoTree *present, UndoTree *target, size_t text_len,
+                    text_adder adder, text_deleter deleter, text_reader reader, void *udata);
+
+/*
+ * Node committed last at or before `when', or the root if there is
+ * none: the state the text was in at that time, as far as edits go.
+ */
+UndoTree *undo_tree_at_time(UndoTree *present, time_t when);
 
 #endif
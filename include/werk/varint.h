@@ -0,0 +1,66 @@
+#ifndef VARINT_H
+#define VARINT_H
+
+#include <limits.h>
+#include <stddef.h>
+
+/*
+ * Unsigned numbers in groups of 7 bits, least significant first, the
+ * high bit of each byte set if another group follows. Used by the undo
+ * records and the crash journal.
+ */
+
+static inline size_t
+varint_len(unsigned long v)
+{
+	size_t n = 1;
+	for (; v >= 0x80; v >>= 7)
+		++n;
+
+	return n;
+}
+
+/*
+ * Store `v' at `p' in at least `width' bytes, padding it with empty
+ * continuation groups. Returns the end of the varint.
+ */
+static inline unsigned char *
+varint_put(unsigned char *p, unsigned long v, size_t width)
+{
+	size_t n = varint_len(v);
+	if (n < width)
+		n = width;
+
+	for (; n > 1; --n) {
+		*p++ = (v & 0x7f) | 0x80;
+		v >>= 7;
+	}
+
+	*p++ = v;
+	return p;
+}
+
+/*
+ * Decode the varint at `p', which must end before `end'. Returns the end
+ * of the varint, or NULL if it doesn't fit or doesn't fit in `v'.
+ */
+static inline const unsigned char *
+varint_get(const unsigned char *p, const unsigned char *end, unsigned long *v)
+{
+	*v = 0;
+	for (int shift = 0; p < end; shift += 7) {
+		unsigned char c = *p++;
+		unsigned long group = c & 0x7f;
+		if (group && (shift >= (int)sizeof(*v) * CHAR_BIT || group > ULONG_MAX >> shift))
+			return NULL;
+
+		if (group)
+			*v |= group << shift;
+		if (!(c & 0x80))
+			return p;
+	}
+
+	return NULL;
+}
+
+#endif
@@ -0,0 +1,520 @@
+#include <werk/chunk.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Chunks are filled up to this size when reading a file, leaving room
+ * for typing.
+ */
+#define CHUNK_FILL (CHUNK_SIZE * 3 / 4)
+
+/*
+ * Largest piece of text inserted into a chunk at once. Inserting it into
+ * a full chunk needs at most one split.
+ */
+#define CHUNK_MAX_INSERT (CHUNK_SIZE / 2)
+
+static struct chunk *
+chunk_new(void)
+{
+	struct chunk *c = malloc(sizeof(struct chunk));
+	c->prev = c->next = NULL;
+	c->gap_offs = 0;
+	c->gap_size = CHUNK_SIZE;
+	return c;
+}
+
+static size_t
+chunk_len(const struct chunk *c)
+{
+	return CHUNK_SIZE - c->gap_size;
+}
+
+static void
+chunk_move_gap(struct chunk *c, size_t offs)
+{
+	if (offs < c->gap_offs)
+		memmove(c->text + offs + c->gap_size, c->text + offs, c->gap_offs - offs);
+	else if (offs > c->gap_offs)
+		memmove(c->text + c->gap_offs, c->text + c->gap_offs + c->gap_size, offs - c->gap_offs);
+
+	c->gap_offs = offs;
+}
+
+static void
+chunk_unlink(struct chunk *c)
+{
+	if (c->prev)
+		c->prev->next = c->next;
+	if (c->next)
+		c->next->prev = c->prev;
+}
+
+/*
+ * Insert text into chunk. If it doesn't fit, the chunk is split in two
+ * and the new right half is returned.
+ */
+static struct chunk *
+chunk_insert(struct chunk *c, size_t offs, const char *str, size_t len)
+{
+	if (len <= c->gap_size) {
+		chunk_move_gap(c, offs);
+		memcpy(c->text + offs, str, len);
+		c->gap_offs += len;
+		c->gap_size -= len;
+		return NULL;
+	}
+
+	size_t clen = chunk_len(c);
+	chunk_move_gap(c, clen);
+
+	char joined[CHUNK_SIZE + CHUNK_MAX_INSERT];
+	memcpy(joined, c->text, offs);
+	memcpy(joined + offs, str, len);
+	memcpy(joined + offs + len, c->text + offs, clen - offs);
+
+	size_t total = clen + len;
+	size_t half = total / 2;
+
+	struct chunk *right = chunk_new();
+	memcpy(right->text, joined + half, total - half);
+	right->gap_offs = total - half;
+	right->gap_size = CHUNK_SIZE - right->gap_offs;
+
+	memcpy(c->text, joined, half);
+	c->gap_offs = half;
+	c->gap_size = CHUNK_SIZE - half;
+
+	right->prev = c;
+	right->next = c->next;
+	if (c->next)
+		c->next->prev = right;
+	c->next = right;
+
+	return right;
+}
+
+/*
+ * Append contents of `src' to `dest', and free `src'.
+ */
+static void
+chunk_merge(struct chunk *dest, struct chunk *src)
+{
+	chunk_move_gap(dest, chunk_len(dest));
+	chunk_move_gap(src, chunk_len(src));
+
+	size_t len = chunk_len(src);
+	memcpy(dest->text + dest->gap_offs, src->text, len);
+	dest->gap_offs += len;
+	dest->gap_size -= len;
+
+	chunk_unlink(src);
+	free(src);
+}
+
+/*
+ * Free subtree of given height, unlinking its chunks.
+ */
+static void
+free_subtree(void *node, int height)
+{
+	if (height == 0) {
+		chunk_unlink(node);
+		free(node);
+		return;
+	}
+
+	struct chunk_node *nd = node;
+	for (int i = 0; i < nd->n; ++i)
+		free_subtree(nd->child[i], height - 1);
+
+	free(nd);
+}
+
+static size_t
+subtree_len(void *node, int height)
+{
+	if (height == 0)
+		return chunk_len(node);
+
+	struct chunk_node *nd = node;
+	size_t len = 0;
+	for (int i = 0; i < nd->n; ++i)
+		len += nd->bytes[i];
+
+	return len;
+}
+
+/*
+ * Index of the child containing `*pos'. `*pos' is made relative to that
+ * child.
+ */
+static int
+child_at(struct chunk_node *nd, size_t *pos)
+{
+	int i;
+	for (i = 0; i < nd->n - 1 && *pos >= nd->bytes[i]; ++i)
+		*pos -= nd->bytes[i];
+
+	return i;
+}
+
+/*
+ * Chunk containing `pos', or the last chunk if `pos' is the end of the
+ * text. Stores the offset of the chunk in `chunk_pos'.
+ */
+static struct chunk *
+find_chunk(ChunkTree *ct, size_t pos, size_t *chunk_pos)
+{
+	struct chunk *c = ct->hint;
+	if (c) {
+		/* sequential access is by far the most common */
+		if (pos >= ct->hint_pos && pos < ct->hint_pos + chunk_len(c)) {
+			*chunk_pos = ct->hint_pos;
+			return c;
+		}
+
+		size_t next_pos = ct->hint_pos + chunk_len(c);
+		if (c->next && pos >= next_pos && pos < next_pos + chunk_len(c->next)) {
+			ct->hint = c->next;
+			*chunk_pos = ct->hint_pos = next_pos;
+			return c->next;
+		}
+	}
+
+	size_t rel = pos;
+	void *node = ct->root;
+	for (int h = ct->height; h > 0; --h) {
+		struct chunk_node *nd = node;
+		node = nd->child[child_at(nd, &rel)];
+	}
+
+	ct->hint = node;
+	*chunk_pos = ct->hint_pos = pos - rel;
+	return node;
+}
+
+/*
+ * Insert at most CHUNK_MAX_INSERT bytes below `node'. If `node' had to
+ * be split, the new right half is returned.
+ */
+static void *
+node_insert(void *node, int height, size_t pos, const char *str, size_t len)
+{
+	if (height == 0)
+		return chunk_insert(node, pos, str, len);
+
+	struct chunk_node *nd = node;
+	int i = child_at(nd, &pos);
+	void *sib = node_insert(nd->child[i], height - 1, pos, str, len);
+	nd->bytes[i] += len;
+	if (!sib)
+		return NULL;
+
+	size_t sib_len = subtree_len(sib, height - 1);
+	nd->bytes[i] -= sib_len;
+
+	int after = nd->n - i - 1;
+	memmove(nd->child + i + 2, nd->child + i + 1, after * sizeof(void *));
+	memmove(nd->bytes + i + 2, nd->bytes + i + 1, after * sizeof(size_t));
+	nd->child[i + 1] = sib;
+	nd->bytes[i + 1] = sib_len;
+	++nd->n;
+
+	if (nd->n <= CHUNK_FANOUT)
+		return NULL;
+
+	struct chunk_node *right = malloc(sizeof(struct chunk_node));
+	int half = nd->n / 2;
+	right->n = nd->n - half;
+	memcpy(right->child, nd->child + half, right->n * sizeof(void *));
+	memcpy(right->bytes, nd->bytes + half, right->n * sizeof(size_t));
+	nd->n = half;
+
+	return right;
+}
+
+/*
+ * Delete text below `node'. Children that became empty are freed, and
+ * small neighbouring chunks are merged.
+ */
+static void
+node_delete(void *node, int height, size_t pos, size_t len)
+{
+	if (height == 0) {
+		struct chunk *c = node;
+		chunk_move_gap(c, pos);
+		c->gap_size += len;
+		return;
+	}
+
+	struct chunk_node *nd = node;
+	for (int i = child_at(nd, &pos); i < nd->n && len; ++i) {
+		size_t n = nd->bytes[i] - pos;
+		if (n > len)
+			n = len;
+
+		node_delete(nd->child[i], height - 1, pos, n);
+		nd->bytes[i] -= n;
+		len -= n;
+		pos = 0;
+	}
+
+	int j = 0;
+	for (int i = 0; i < nd->n; ++i) {
+		if (nd->bytes[i] == 0) {
+			free_subtree(nd->child[i], height - 1);
+			continue;
+		}
+
+		if (height == 1 && j > 0 && nd->bytes[j - 1] + nd->bytes[i] <= CHUNK_SIZE / 2) {
+			chunk_merge(nd->child[j - 1], nd->child[i]);
+			nd->bytes[j - 1] += nd->bytes[i];
+			continue;
+		}
+
+		nd->child[j] = nd->child[i];
+		nd->bytes[j] = nd->bytes[i];
+		++j;
+	}
+
+	nd->n = j;
+}
+
+/*
+ * Length of the longest prefix of `str' that doesn't end in the middle
+ * of a UTF-8 sequence.
+ */
+static size_t
+utf8_prefix(const char *str, size_t len)
+{
+	const unsigned char *s = (const unsigned char *)str;
+
+	size_t i = len;
+	while (i > 0 && len - i < 4 && (s[i - 1] & 0xc0) == 0x80)
+		--i;
+
+	if (i == 0)
+		return len;
+
+	unsigned char lead = s[i - 1];
+	size_t seq_len = lead >= 0xf0 ? 4 : lead >= 0xe0 ? 3 : lead >= 0xc0 ? 2 : 1;
+	return (len - (i - 1) >= seq_len) ? len : i - 1;
+}
+
+ChunkTree *
+ctree_read(FILE *in)
+{
+	size_t n = 0, cap = 64;
+	void **level = malloc(cap * sizeof(void *));
+	size_t *bytes = malloc(cap * sizeof(size_t));
+
+	struct chunk *prev = NULL;
+	size_t len = 0, carry = 0;
+
+	for (;;) {
+		struct chunk *c = chunk_new();
+
+		/* incomplete UTF-8 sequence at the end of the previous
+		 * chunk, still there in its gap */
+		if (carry)
+			memcpy(c->text, prev->text + prev->gap_offs, carry);
+
+		size_t want = CHUNK_FILL - carry;
+		size_t got = fread(c->text + carry, 1, want, in);
+		if (ferror(in)) {
+			fprintf(stderr, "error reading buffer: fread() failed.\n");
+			free(c);
+			goto error;
+		}
+
+		/* chunks don't split UTF-8 sequences, see lidx_rebuild() */
+		bool eof = got < want;
+		size_t have = carry + got;
+		size_t keep = eof ? have : utf8_prefix(c->text, have);
+		carry = have - keep;
+
+		if (keep == 0 && n > 0) {
+			free(c);
+			break;
+		}
+
+		c->gap_offs = keep;
+		c->gap_size = CHUNK_SIZE - keep;
+
+		c->prev = prev;
+		if (prev)
+			prev->next = c;
+		prev = c;
+
+		if (n == cap) {
+			cap *= 2;
+			level = realloc(level, cap * sizeof(void *));
+			bytes = realloc(bytes, cap * sizeof(size_t));
+		}
+
+		level[n] = c;
+		bytes[n] = keep;
+		++n;
+		len += keep;
+
+		if (eof)
+			break;
+	}
+
+	/* build tree bottom-up, spreading children evenly */
+	int height = 0;
+	while (n > 1) {
+		size_t parents = (n + CHUNK_FANOUT - 1) / CHUNK_FANOUT;
+
+		for (size_t k = 0; k < parents; ++k) {
+			size_t from = k * n / parents;
+			size_t until = (k + 1) * n / parents;
+
+			struct chunk_node *nd = malloc(sizeof(struct chunk_node));
+			nd->n = until - from;
+
+			size_t sum = 0;
+			for (size_t i = from; i < until; ++i) {
+				nd->child[i - from] = level[i];
+				nd->bytes[i - from] = bytes[i];
+				sum += bytes[i];
+			}
+
+			level[k] = nd;
+			bytes[k] = sum;
+		}
+
+		n = parents;
+		++height;
+	}
+
+	ChunkTree *ct = malloc(sizeof(ChunkTree));
+	ct->root = level[0];
+	ct->height = height;
+	ct->len = len;
+	ct->hint = NULL;
+	ct->hint_pos = 0;
+
+	free(level);
+	free(bytes);
+	return ct;
+
+error:
+	while (prev) {
+		struct chunk *c = prev;
+		prev = c->prev;
+		free(c);
+	}
+
+	free(level);
+	free(bytes);
+	return NULL;
+}
+
+void
+ctree_destroy(ChunkTree *ct)
+{
+	free_subtree(ct->root, ct->height);
+	free(ct);
+}
+
+void
+ctree_insert(ChunkTree *ct, size_t pos, const char *str, size_t len)
+{
+	ct->hint = NULL;
+
+	while (len) {
+		size_t n = len < CHUNK_MAX_INSERT ? len : CHUNK_MAX_INSERT;
+
+		void *sib = node_insert(ct->root, ct->height, pos, str, n);
+		if (sib) {
+			/* grow a new root */
+			struct chunk_node *root = malloc(sizeof(struct chunk_node));
+			root->n = 2;
+			root->child[0] = ct->root;
+			root->child[1] = sib;
+			root->bytes[1] = subtree_len(sib, ct->height);
+			root->bytes[0] = ct->len + n - root->bytes[1];
+
+			ct->root = root;
+			++ct->height;
+		}
+
+		ct->len += n;
+		pos += n;
+		str += n;
+		len -= n;
+	}
+}
+
+void
+ctree_delete(ChunkTree *ct, size_t pos, size_t len)
+{
+	if (pos >= ct->len)
+		return;
+
+	if (pos + len > ct->len)
+		len = ct->len - pos;
+
+	if (len == 0)
+		return;
+
+	ct->hint = NULL;
+	node_delete(ct->root, ct->height, pos, len);
+	ct->len -= len;
+
+	if (ct->height > 0 && ((struct chunk_node *)ct->root)->n == 0) {
+		/* everything was deleted */
+		free(ct->root);
+		ct->root = chunk_new();
+		ct->height = 0;
+	}
+
+	while (ct->height > 0 && ((struct chunk_node *)ct->root)->n == 1) {
+		struct chunk_node *old_root = ct->root;
+		ct->root = old_root->child[0];
+		--ct->height;
+		free(old_root);
+	}
+}
+
+const char *
+ctree_get(ChunkTree *ct, size_t pos, size_t *run)
+{
+	size_t chunk_pos;
+	struct chunk *c = find_chunk(ct, pos, &chunk_pos);
+	size_t offs = pos - chunk_pos;
+
+	if (offs < c->gap_offs) {
+		if (run)
+			*run = c->gap_offs - offs;
+		return c->text + offs;
+	}
+
+	if (run)
+		*run = chunk_len(c) - offs;
+	return c->text + offs + c->gap_size;
+}
+
+const char *
+ctree_get_before(ChunkTree *ct, size_t pos, size_t *run)
+{
+	if (pos == 0) {
+		*run = 0;
+		return ctree_get(ct, pos, NULL);
+	}
+
+	size_t chunk_pos;
+	struct chunk *c = find_chunk(ct, pos - 1, &chunk_pos);
+	size_t offs = pos - chunk_pos;
+
+	if (offs <= c->gap_offs) {
+		*run = offs;
+		return c->text + offs;
+	}
+
+	*run = offs - c->gap_offs;
+	return c->text + offs + c->gap_size;
+}
@@ -35,6 +35,8 @@ config_load_defaults(Config *cfg)
 	cfg->text.default_newline = "\n";
 #endif
 	cfg->text.indentation = 0;
+	cfg->text.storage = GBUF_STORAGE_GAP;
+	cfg->text.undo_memory = 64 << 20;
 }
 
 /*
@@ -50,6 +52,18 @@ static void indentation_callback(ConfigReader *rdr, const char *str, void *udata
  */
 static void newline_callback(ConfigReader *rdr, const char *str, void *udata);
 
+/*
+ * ConfigReader callback, reads "gap", "pieces" and "chunks" into
+ * (GBufStorage *)udata.
+ */
+static void storage_callback(ConfigReader *rdr, const char *str, void *udata);
+
+/*
+ * ConfigReader callback, reads "%d KiB", "%d MiB", "%d GiB" and
+ * "unlimited" into (size_t *)udata, in bytes.
+ */
+static void memory_callback(ConfigReader *rdr, const char *str, void *udata);
+
 static void
 config_setup_reader(Config *conf, ConfigReader *rdr)
 {
@@ -79,6 +93,8 @@ config_setup_reader(Config *conf, ConfigReader *rdr)
 	config_add_opt_flags(rdr, "editor.show-invisibles", invs_names, invs_vals);
 	config_add_opt(rdr, "text.indentation", indentation_callback, &conf->text.indentation);
 	config_add_opt(rdr, "text.default-newline", newline_callback, &conf->text.default_newline);
+	config_add_opt(rdr, "text.storage", storage_callback, &conf->text.storage);
+	config_add_opt(rdr, "text.undo-memory", memory_callback, &conf->text.undo_memory);
 }
 
 void
@@ -183,3 +199,56 @@ newline_callback(ConfigReader *rdr, const char *str, void *udata)
 
 	config_report(rdr, "%s line %d: expected `unix', `dos' or `U+XXXX'\n");
 }
+
+static void
+storage_callback(ConfigReader *rdr, const char *str, void *udata)
+{
+	GBufStorage *value = udata;
+
+	if (!sparsef(str, "gap")) {
+		*value = GBUF_STORAGE_GAP;
+		return;
+	}
+
+	if (!sparsef(str, "pieces")) {
+		*value = GBUF_STORAGE_PIECE;
+		return;
+	}
+
+	if (!sparsef(str, "chunks")) {
+		*value = GBUF_STORAGE_CHUNK;
+		return;
+	}
+
+	if (!sparsef(str, "gaps")) {
+		*value = GBUF_STORAGE_GAPS;
+		return;
+	}
+
+	config_report(rdr, "expected `gap', `gaps', `pieces' or `chunks', not ``%s''\n", str);
+}
+
+static void
+memory_callback(ConfigReader *rdr, const char *str, void *udata)
+{
+	size_t *value = udata;
+
+	if (!sparsef(str, "unlimited")) {
+		*value = 0;
+		return;
+	}
+
+	static const char *const units[] = { "%d KiB", "%d MiB", "%d GiB" };
+	for (int i = 0; i < 3; ++i) {
+		int n;
+		if (!sparsef(str, units[i], &n)) {
+			if (n <= 0)
+				config_report(rdr, "invalid: `%s'\n", str);
+			else
+				*value = (size_t)n << 10 * (i + 1);
+			return;
+		}
+	}
+
+	config_report(rdr, "expected `NUM KiB', `NUM MiB', `NUM GiB' or `unlimited', not ``%s''\n", str);
+}
@@ -3,6 +3,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <unictype.h>
 #include <unigbrk.h>
 #include <unistd.h>
@@ -11,6 +12,7 @@
 #include <werk/conf/app.h>
 #include <werk/edit.h>
 #include <werk/mode/mode.h>
+#include <werk/scan.h>
 #include <werk/gap.h>
 
 #define CMD_DIALOG_WIDTH 30
@@ -39,11 +41,11 @@ static void buf_destroy(Buffer *buf);
 static int buf_read(Buffer *buf, const char *filename);
 
 /*
- * Sets `buf->eol' and `buf->eol_size' to the value of the first newline
- * found in the buffer. Otherwise it uses "text.default-newline" from
- * the configuration.
+ * Sets `buf->eol' and `buf->eol_size' to `eol', the most common newline
+ * in the buffer. If it is NULL, it uses "text.default-newline" from the
+ * configuration.
  */
-static void buf_detect_newline(Buffer *buf);
+static void buf_detect_newline(Buffer *buf, const char *eol);
 
 /*
  * Set `buf->lang' to appropriate value
@@ -51,36 +53,108 @@ static void buf_detect_newline(Buffer *buf);
  */
 static void buf_detect_lang(Buffer *buf);
 
+/*
+ * Path of the undo history of `filename', `.NAME.werk-undo'. The result
+ * must be freed.
+ */
+static char *history_path(const char *filename);
+
+/*
+ * Restore the undo history saved along with `filename', if it is still
+ * the file that was saved.
+ */
+static void buf_load_history(Buffer *buf, const char *filename);
+
+/*
+ * Save the undo history next to the buffer's file, which was just
+ * saved.
+ */
+static void buf_save_history(Buffer *buf);
+
+/*
+ * Start journaling the changes to the buffer, after making those of a
+ * journal left behind by a crash again. See journal.h.
+ */
+static void buf_journal_open(Buffer *buf);
+
+/*
+ * Save buffer by writing to a temporary file and renaming it to
+ * `buf->filename'. Used by buf_save() when the old file is still
+ * mapped into memory, so it must not be overwritten.
+ */
+static int buf_save_by_rename(Buffer *buf);
+
 static void buf_insert_text_no_notify(Buffer *buf, const char *input, size_t len);
 static void buf_delete_selection_no_notify(Buffer *buf);
 
 /*
- * Counts the number of newlines currently in the selection.
- * NOTE: Quite expensive!
+ * Edit of the selection (`sel_start' and `sel_finish'), which may
+ * move it.
  */
-static int buf_count_sel_newlines(Buffer *buf);
+typedef void (*sel_edit)(Buffer *buf, const void *arg);
 
 /*
- * Determine if `marker' should be moved from `hi_markers' to
- * `lo_markers' or vice versa, and do so if needed.
- *
- * Returns whether a traversal actually occured.
+ * Apply `edit' to every selection in turn, from the end of the text to
+ * its start, so that the gap of a gap buffer only ever moves backward
+ * and edits don't move the selections that are yet to come. The
+ * primary selection takes part through temporary marks of its own.
+ * Selections that overlap are merged, before and after.
+ */
+static void buf_each_selection(Buffer *buf, sel_edit edit, const void *arg);
+
+/*
+ * Add or remove the primary selection to or from `buf->sels', as
+ * `primary'. Both sort the selections and merge overlapping ones,
+ * since the primary selection moves on its own, for instance when
+ * undoing.
+ */
+static void sels_add_primary(Buffer *buf, Selection *primary);
+static void sels_remove_primary(Buffer *buf, Selection *primary);
+
+/*
+ * Tell the undo tree that the text between `left' and `right' is about
+ * to be removed.
+ */
+static void buf_notify_delete(Buffer *buf, const BufferMarker *left, const BufferMarker *right);
+
+/*
+ * Must be called after every change to `buf->gbuf': `removed' bytes at
+ * `offs' were replaced by `added' bytes. Updates the line index,
+ * `buf->lines' and the marks.
+ */
+static void buf_lines_changed(Buffer *buf, gbuf_offs offs, size_t removed, size_t added);
+
+/*
+ * Recalculate the `col' of the marks from `from' up to the end of line
+ * `last_line'.
+ */
+static void marks_update_cols(Buffer *buf, gbuf_offs from, int last_line);
+/*
+ * Widen the range of marks whose columns buf_end_batch() recalculates
+ * to take in an edit, like buf_lines_changed() describes it.
  */
-static bool traverse(Buffer *buf, BufferMarker *marker);
+static void batch_touch(Buffer *buf, gbuf_offs offs, size_t removed, size_t added);
 
 /*
- * Shifts all markers so that they are no longer in the seleciton.
- * Only modifies `buf->lo_markers'.
+ * Forget all column checkpoints.
+ */
+static void col_cache_clear(Buffer *buf);
+/*
+ * Column checkpoints of the line starting at `line_start', for the
+ * current tab width. Evicts another line if it isn't cached yet.
  */
-static void buf_clear_sel_of_markers(Buffer *buf);
+static struct col_cache *col_cache_get(Buffer *buf, gbuf_offs line_start);
+/*
+ * Move or drop checkpoints after `removed' bytes at `offs' were replaced
+ * by `added' bytes. Only checkpoints from `offs' on are dropped, the
+ * columns before it are unchanged.
+ */
+static void col_cache_update(Buffer *buf, gbuf_offs offs, size_t removed, size_t added);
 
 /*
- * The `col' field of any markers in hi_markers that are on the same
- * line as the one to which text is added or removed are invalidated and
- * have to be recalculated. For this they need not be removed from the
- * tree, since the `col' field has no effect on ordering.
+ * Set position of `marker'.
  */
-static void buf_recalc_hi_marker_cols(Buffer *buf);
+static void marker_set(BufferMarker *marker, gbuf_offs offs, int line, int col);
 
 /*
  * Calculate viewport origin to make sure that the end of the selection
@@ -94,6 +168,17 @@ static void buf_calc_vp_origin(Buffer *buf, int wlines, int hlines);
  */
 static void buf_get_viewport(Buffer *buf, int *vw, int *vh, int wlines, int hlines);
 
+/*
+ * Highlight the text between `start' and `finish', or the character
+ * at `start' if they are the same.
+ */
+static void buf_draw_selection(Buffer *buf,
+                               Drawer *d,
+                               BufferMarker start,
+                               BufferMarker finish,
+                               int vw, int vh,
+                               int offset_x);
+
 /*
  * Draw single grapheme. Used by buf_draw_line().
  */
@@ -156,12 +241,6 @@ static void draw_cmd_dialog(Buffer *buf, Drawer *d, int ww, int wh);
 int
 cmp_buffer_markers(const BufferMarker *a, const BufferMarker *b)
 {
-	if (a->rtol < b->rtol)
-		return -1;
-
-	if (a->rtol > b->rtol)
-		return 1;
-
 	if (a->offset < b->offset)
 		return -1;
 
@@ -171,59 +250,39 @@ cmp_buffer_markers(const BufferMarker *a, const BufferMarker *b)
 	return 0;
 }
 
-int
-cmp_buffer_markers_rbtree(struct rb_tree *tree, struct rb_node *a, struct rb_node *b)
-{
-	int cmp = cmp_buffer_markers(a->value, b->value);
-
-	/* because rb_tree_find() should still retrieve the correct
-	 * marker, not just a marker at the same location as the sought
-	 * marker */
-	if (cmp == 0) {
-		uintptr_t ua = (uintptr_t)a->value;
-		uintptr_t ub = (uintptr_t)b->value;
-		if (ua < ub)
-			return -1;
-
-		if (ua > ub)
-			return 1;
-
-		return 0;
-	}
-
-	return cmp;
-}
-
 static void
 buf_init(Buffer *buf, WerkInstance *werk)
 {
 	memset(buf, 0, sizeof(*buf));
 
 	gbuf_init(&buf->gbuf);
+	lidx_init(&buf->line_idx);
 	cmd_dialog_init(buf);
 
 	buf->werk = werk;
 	buf->vp_orig_col = buf->vp_orig_line
 	                 = buf->buf_start.col
-	                 = buf->buf_start.line
 	                 = buf->buf_end.col
-	                 = buf->buf_end.rtol
 	                 = buf->sel_start.line
 	                 = buf->sel_start.col
 	                 = buf->sel_finish.line
 	                 = buf->sel_finish.col
 			 = buf->lines = 1;
 
-	buf->lo_markers = rb_tree_create(cmp_buffer_markers_rbtree);
-	rb_tree_insert(buf->lo_markers, &buf->buf_start);
-	buf->hi_markers = rb_tree_create(cmp_buffer_markers_rbtree);
-	rb_tree_insert(buf->hi_markers, &buf->buf_end);
+	col_cache_clear(buf);
+	buf->batch_from = -1;
+
+	mtree_init(&buf->marks);
+	mtree_insert(&buf->marks, &buf->buf_start, 0, 1);
+	buf->buf_end.right_gravity = true;
+	mtree_insert(&buf->marks, &buf->buf_end, 0, 1);
 
 	/* is reset later using buf_detect_newline() */
 	buf->eol = werk->cfg.text.default_newline;
 	buf->eol_size = strlen(buf->eol);
 
-	buf->present = undo_tree_init();
+	buf->present = undo_tree_init(buf->werk->cfg.text.undo_memory);
+	journal_init(&buf->journal);
 
 	push_select_mode(buf);
 }
@@ -237,23 +296,19 @@ cmd_dialog_init(Buffer *buf)
 	buf->dialog.active = false;
 }
 
-static void
-destroy_node(struct rb_tree *tree, struct rb_node *node)
-{
-	rb_node_dealloc(node);
-}
-
 static void
 buf_destroy(Buffer *buf)
 {
 	gbuf_destroy(&buf->gbuf);
+	lidx_destroy(&buf->line_idx);
+	col_cache_clear(buf);
 	gbuf_destroy(&buf->dialog.gbuf);
 	free((char *)buf->filename);
 
-	rb_tree_dealloc(buf->lo_markers, destroy_node);
-	rb_tree_dealloc(buf->hi_markers, destroy_node);
+	buf_clear_selections(buf);
 
 	undo_tree_destroy(buf->present);
+	journal_close(&buf->journal);
 
 	while (buf->mode)
 		pop_mode(buf);
@@ -263,139 +318,265 @@ static int
 buf_read(Buffer *buf, const char *filename)
 {
 	undo_tree_destroy(buf->present);
-	buf->present = undo_tree_init();
+	buf->present = undo_tree_init(buf->werk->cfg.text.undo_memory);
 
 	FILE *in = fopen(filename, "rb");
 	if (!in)
 		goto no_such_file;
 
-	size_t ln = gbuf_len(&buf->gbuf);
-	char *backup = malloc(ln);
-	if (!backup) {
-		fprintf(stderr, "out of memory\n");
-		return -1;
+	/* read into a fresh buffer, so the current text stays untouched
+	 * if reading fails */
+	GapBuf gbuf;
+	gbuf_init(&gbuf);
+
+	/* A mapped file is only paged in by lidx_rebuild(), which checks
+	 * for UTF-8 in the same pass */
+	LidxStats stats;
+	int err = gbuf_read(&gbuf, in, buf->werk->cfg.text.storage);
+	if (!err && lidx_rebuild(&buf->line_idx, &gbuf, &stats)) {
+		fprintf(stderr, "error reading buffer: file is not UTF-8.\n");
+		err = -1;
 	}
 
-	gbuf_strcpy(&buf->gbuf, backup, 0, ln);
+	fclose(in);
 
-	if (gbuf_read(&buf->gbuf, in)) {
-		gbuf_clear(&buf->gbuf);
-		gbuf_insert_text(&buf->gbuf, 0, backup, ln);
-		free(backup);
+	if (err) {
+		gbuf_destroy(&gbuf);
 		return -1;
 	}
 
-	free(backup);
-
-	/* Count number of newlines in file.
-	 * Relies on the fact that the gap buffer text should be
-	 * uninterrupted (so we don't need to use the slightly more
-	 * expensive gbuf_grapheme_next() ). */
-	int lines = 1;
-	const char *it = buf->gbuf.start;
-	const char *stop = it + gbuf_len(&buf->gbuf);
-	while (it != stop) {
-		const char *nxt = u8_grapheme_next(it, stop);
-		size_t len = nxt - it;
-		if (grapheme_is_newline(it, len))
-			++lines;
-
-		it = nxt;
-	}
-
-	buf->lines = lines;
-
-	/* If there is no final newline, the buf_end marker needs a
-	 * column recalculation */
-	assert(rb_tree_size(buf->hi_markers) == 1); /* only buf_end */
-	buf->buf_end.col = grapheme_column(buf, marker_offs(buf, &buf->buf_end));
+	gbuf_destroy(&buf->gbuf);
+	buf->gbuf = gbuf;
+	col_cache_clear(buf);
+
+	buf->lines = lidx_lines(&buf->line_idx);
+
+	/* all text was replaced, so buf_end needs a new position. If there
+	 * is no final newline, it also needs a column recalculation */
+	gbuf_offs end = gbuf_len(&buf->gbuf);
+	mtree_remove(&buf->marks, &buf->buf_end);
+	mtree_insert(&buf->marks, &buf->buf_end, end, buf->lines);
+	if (stats.plain_last_line)
+		buf->buf_end.col = end - lidx_line_start(&buf->line_idx, buf->lines) + 1;
+	else
+		buf->buf_end.col = grapheme_column(buf, end);
 
-	buf_detect_newline(buf);
+	buf_detect_newline(buf, stats.eol);
+	buf_load_history(buf, filename);
 
 no_such_file:
 	buf->filename = strdup(filename);
 	buf_detect_lang(buf);
+	buf_journal_open(buf);
 
 	return 0;
 }
 
+static char *
+history_path(const char *filename)
+{
+	return sidecar_path(filename, ".werk-undo");
+}
+
 static void
-buf_detect_newline(Buffer *buf)
-{
-	static const char *newlines[] = {
-		u8"\r\n", u8"\r", u8"\f", u8"\v",
-		u8"\xc2\x85", u8"\u2028", u8"\u2029",
-	};
-
-	gbuf_offs offs = 0;
-	const char *graph;
-	size_t graph_len;
-	while (!gbuf_grapheme_next(&buf->gbuf, &graph, &graph_len, &offs)) {
-		if (!grapheme_is_newline(graph, graph_len) || graph_len == 0)
-			continue;
+buf_load_history(Buffer *buf, const char *filename)
+{
+	/* the history is saved with the stamp of the file as it was
+	 * saved, and only applies to that file */
+	FileStamp key = file_stamp(filename);
+	if (key.size < 0)
+		return;
 
-		/* the following loop is guaranteed to cause a return */
-		for (int i = 0; i < sizeof(newlines) / sizeof(newlines[0]); ++i) {
-			const char *nl = newlines[i];
-			size_t nl_size = strlen(nl);
+	char *path = history_path(filename);
+	UndoTree *present = undo_tree_load(path, &key, sizeof(key), buf->werk->cfg.text.undo_memory);
+	free(path);
+	if (!present)
+		return;
 
-			if (strncmp(graph, nl, nl_size))
-				continue;
+	undo_tree_destroy(buf->present);
+	buf->present = present;
+}
 
-			buf->eol = nl;
-			buf->eol_size = nl_size;
-			return;
-		}
-	}
+static void
+buf_save_history(Buffer *buf)
+{
+	FileStamp key = file_stamp(buf->filename);
+	if (key.size < 0)
+		return;
+
+	char *path = history_path(buf->filename);
+	undo_tree_save(buf->present, path, &key, sizeof(key));
+	free(path);
+}
+
+static void
+buf_detect_newline(Buffer *buf, const char *eol)
+{
+	if (!eol)
+		eol = buf->werk->cfg.text.default_newline;
 
-	const char *dflt = buf->werk->cfg.text.default_newline;
-	buf->eol = dflt;
-	buf->eol_size = strlen(dflt);
+	buf->eol = eol;
+	buf->eol_size = strlen(eol);
 }
 
 static void
 buf_detect_lang(Buffer *buf)
 {
-	BufferMarker mk = { .line = 1, .col = 1 };
-	marker_end_of_line(buf, &mk);
+	/* shebangs are matched by prefix, so the start of the first line
+	 * will do */
+	char l1[64];
+	size_t l1_len = gbuf_len(&buf->gbuf);
+	if (l1_len > sizeof(l1) - 1)
+		l1_len = sizeof(l1) - 1;
 
-	size_t l1_len = mk.offset;
-	char *l1 = malloc(l1_len + 1);
-	if (!l1) {
-		fprintf(stderr, "failed to detect language: first line too long\n");
-		return;
-	}
-	l1[l1_len] = '\0';
 	gbuf_strcpy(&buf->gbuf, l1, 0, l1_len);
+	l1[l1_len] = '\0';
+	l1[strcspn(l1, "\r\n\f\v")] = '\0';
 
 	lang_detect(buf->filename, l1, &buf->lang);
+}
+
+static void
+buf_lines_changed(Buffer *buf, gbuf_offs offs, size_t removed, size_t added)
+{
+	if (removed)
+		journal_delete(&buf->journal, offs, removed);
+
+	char *journaled = added ? journal_add(&buf->journal, offs, added) : NULL;
+	if (journaled)
+		gbuf_strcpy(&buf->gbuf, journaled, offs, added);
+
+	int old_lines = buf->lines;
+	lidx_update(&buf->line_idx, &buf->gbuf, offs, removed, added);
+	buf->lines = lidx_lines(&buf->line_idx);
+	col_cache_update(buf, offs, removed, added);
 
-	free(l1);
+	int line = lidx_line_of(&buf->line_idx, offs, NULL);
+	mtree_edit(&buf->marks, offs, removed, added, buf->lines - old_lines, line);
+
+	/* columns of marks after the edit, on its last line, changed */
+	if (buf->batch)
+		batch_touch(buf, offs, removed, added);
+	else
+		marks_update_cols(buf, offs, lidx_line_of(&buf->line_idx, offs + added, NULL));
 }
 
-static int
-buf_count_sel_newlines(Buffer *buf)
+static void
+marks_update_cols(Buffer *buf, gbuf_offs from, int last_line)
 {
-	BufferMarker *left, *right;
-	marker_sort_pair(&buf->sel_start, &buf->sel_finish, &left, &right);
+	for (Mark *m = mtree_first_from(&buf->marks, from); m; m = mark_next(m)) {
+		if (mark_line(m) > last_line)
+			break;
 
-	BufferMarker it = *left;
-	gbuf_offs right_ofs = right->offset;
+		m->col = grapheme_column(buf, mark_offset(m));
+	}
+}
 
-	int res = 0;
+static void
+batch_touch(Buffer *buf, gbuf_offs offs, size_t removed, size_t added)
+{
+	gbuf_offs until = offs + (gbuf_offs)added;
+	if (buf->batch_from < 0) {
+		buf->batch_from = offs;
+		buf->batch_until = until;
+		return;
+	}
 
-	while (it.offset < right_ofs) {
-		const char *s;
-		size_t l;
+	/* the range so far moves along with the text, like a mark */
+	gbuf_offs delta = (gbuf_offs)added - (gbuf_offs)removed;
+	if (buf->batch_from >= offs + (gbuf_offs)removed)
+		buf->batch_from += delta;
+	else if (buf->batch_from > offs)
+		buf->batch_from = offs;
 
-		if (marker_next(buf, &s, &l, &it))
+	if (buf->batch_until >= offs + (gbuf_offs)removed)
+		buf->batch_until += delta;
+	else if (buf->batch_until > offs)
+		buf->batch_until = offs;
+
+	if (offs < buf->batch_from)
+		buf->batch_from = offs;
+	if (until > buf->batch_until)
+		buf->batch_until = until;
+}
+
+static void
+col_cache_clear(Buffer *buf)
+{
+	for (int i = 0; i < COL_CACHE_LINES; ++i) {
+		struct col_cache *cc = &buf->col_cache[i];
+		free(cc->points);
+		memset(cc, 0, sizeof(*cc));
+		cc->line_start = -1;
+	}
+}
+
+static struct col_cache *
+col_cache_get(Buffer *buf, gbuf_offs line_start)
+{
+	int tab_width = buf->werk->cfg.editor.tab_width;
+
+	struct col_cache *cc = NULL;
+	for (int i = 0; i < COL_CACHE_LINES; ++i) {
+		struct col_cache *c = &buf->col_cache[i];
+		if (c->line_start == line_start) {
+			cc = c;
 			break;
+		}
 
-		if (grapheme_is_newline(s, l))
-			++res;
+		if (!cc || c->used < cc->used)
+			cc = c;
 	}
 
-	return res;
+	if (cc->line_start != line_start || cc->tab_width != tab_width) {
+		cc->line_start = line_start;
+		cc->tab_width = tab_width;
+		cc->n = 0;
+	}
+
+	cc->used = ++buf->col_cache_clock;
+	return cc;
+}
+
+static void
+col_cache_update(Buffer *buf, gbuf_offs offs, size_t removed, size_t added)
+{
+	for (int i = 0; i < COL_CACHE_LINES; ++i) {
+		struct col_cache *cc = &buf->col_cache[i];
+		if (cc->line_start < 0)
+			continue;
+
+		if (offs + (gbuf_offs)removed < cc->line_start) {
+			/* the line moved as a whole */
+			cc->line_start += (gbuf_offs)added - (gbuf_offs)removed;
+		} else if (offs < cc->line_start) {
+			/* the newline before the line was touched */
+			cc->line_start = -1;
+			cc->n = 0;
+		} else {
+			while (cc->n && cc->line_start + cc->points[cc->n - 1].rel >= offs)
+				--cc->n;
+		}
+	}
+}
+
+/*
+ * Record a checkpoint at `rel' bytes into the line of `cc'.
+ */
+static void
+col_cache_push(struct col_cache *cc, gbuf_offs rel, int col)
+{
+	if (cc->n == cc->cap) {
+		size_t new_cap = cc->cap ? cc->cap * 2 : 16;
+		struct col_checkpoint *new_points = realloc(cc->points, new_cap * sizeof(*new_points));
+		if (!new_points)
+			return;
+
+		cc->points = new_points;
+		cc->cap = new_cap;
+	}
+
+	cc->points[cc->n++] = (struct col_checkpoint){ .rel = rel, .col = col };
 }
 
 bool
@@ -407,18 +588,18 @@ buf_is_selection_degenerate(Buffer *buf)
 bool
 grapheme_is_newline(const char *str, size_t len)
 {
+	const unsigned char *s = (const unsigned char *)str;
+
 	switch (len) {
 	case 1:
-		return !strncmp(str, u8"\n", len)
-	    	    || !strncmp(str, u8"\r", len)
-	    	    || !strncmp(str, u8"\f", len)
-	    	    || !strncmp(str, u8"\v", len);
+		/* \n \v \f \r */
+		return s[0] >= '\n' && s[0] <= '\r';
 	case 2:
-		return !strncmp(str, u8"\r\n", len)
-		    || !strncmp(str, u8"\xc2\x85", len); /* u0085 */
+		return (s[0] == '\r' && s[1] == '\n')
+		    || (s[0] == 0xc2 && s[1] == 0x85); /* u0085 */
 	case 3:
-		return !strncmp(str, u8"\u2028", len)
-	    	    || !strncmp(str, u8"\u2029", len);
+		/* u2028, u2029 */
+		return s[0] == 0xe2 && s[1] == 0x80 && (s[2] == 0xa8 || s[2] == 0xa9);
 	case 0:
 		return true;
 	default:
@@ -437,44 +618,120 @@ grapheme_width(const char *str, size_t n, int col, int tab_width)
 	if (n == 0)
 		return 0;
 
+	/* what uc_width() says for ASCII */
+	if (n == 1 && !(str[0] & 0x80)) {
+		if (str[0] >= 0x20 && str[0] < 0x7f)
+			return 1;
+		return str[0] ? -1 : 0;
+	}
+
 	ucs4_t base;
 	u8_mbtoucr(&base, str, n);
 	return uc_width(base, "C");
 }
 
-int
-grapheme_column(Buffer *buf, gbuf_offs ofs)
+/*
+ * Number of leading bytes of `str' that are printable ASCII, and can be
+ * counted as one column each. The last one is left out if more text
+ * follows, since it might carry combining marks.
+ */
+static size_t
+plain_prefix(const char *str, size_t len, bool more)
 {
-	const char *bufstop = buf->gbuf.start;
+	size_t plain = scan_printable(str, len);
+	if (plain && (plain < len || more))
+		--plain;
 
-	/* find last newline */
+	return plain;
+}
 
-	/* character after last eol */
-	gbuf_offs last_eol = ofs;
-	for (;;) {
-		gbuf_offs prev_ofs = last_eol;
-		const char *graph;
-		size_t len;
-		if (gbuf_grapheme_prev(&buf->gbuf, &graph, &len, &prev_ofs) == -1)
-			break;
+/*
+ * Column reached after `str' is drawn starting at column `col'.
+ */
+static int
+advance_column(const char *str, size_t len, int col, int tab_width)
+{
+	const char *stop = str + len;
 
-		if (grapheme_is_newline(graph, len))
-			break;
+	while (str != stop) {
+		size_t plain = plain_prefix(str, stop - str, false);
+		if (plain) {
+			col += plain;
+			str += plain;
+			continue;
+		}
 
-		last_eol = prev_ofs;
+		const char *nxt = grapheme_next_fast(str, stop);
+		size_t graph_len = nxt - str;
+
+		if (grapheme_is_newline(str, graph_len))
+			col = 1;
+		else
+			col += grapheme_width(str, graph_len, col, tab_width);
+
+		str = nxt;
 	}
 
-	/* measure line until ofs */
-	int res = 1;
+	return col;
+}
+
+int
+grapheme_column(Buffer *buf, gbuf_offs ofs)
+{
+	/* character after last eol */
+	gbuf_offs last_eol;
+	lidx_line_of(&buf->line_idx, ofs, &last_eol);
+
+	/* start at the last checkpoint before ofs */
+	struct col_cache *cc = col_cache_get(buf, last_eol);
+	size_t lo = 0, hi = cc->n;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (last_eol + cc->points[mid].rel <= ofs)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
 
+	int res = 1;
 	gbuf_offs scan = last_eol;
+	if (lo) {
+		res = cc->points[lo - 1].col;
+		scan += cc->points[lo - 1].rel;
+	}
+
+	/* new checkpoints can only be added after the last one */
+	bool extend = lo == cc->n;
+
+	/* measure line until ofs */
 	while (scan != ofs) {
-		const char *graph;
-		size_t len;
-		if (gbuf_grapheme_next(&buf->gbuf, &graph, &len, &scan))
-			break;
+		gbuf_offs stop = ofs;
+		if (extend) {
+			gbuf_offs next_point = last_eol + (gbuf_offs)(cc->n + 1) * COL_CHECKPOINT;
+			if (next_point > scan && next_point < stop)
+				stop = next_point;
+		}
+
+		size_t run;
+		const char *text = gbuf_get_run(&buf->gbuf, scan, &run);
+		if (run > stop - scan)
+			run = stop - scan;
+
+		size_t plain = plain_prefix(text, run, scan + run != ofs);
+		if (plain) {
+			res += plain;
+			scan += plain;
+		} else {
+			const char *graph;
+			size_t len;
+			if (gbuf_grapheme_next(&buf->gbuf, &graph, &len, &scan))
+				break;
+
+			res += grapheme_width(graph, len, res, buf->werk->cfg.editor.tab_width);
+		}
 
-		res += grapheme_width(graph, len, res, buf->werk->cfg.editor.tab_width);
+		if (extend && scan - last_eol >= (gbuf_offs)(cc->n + 1) * COL_CHECKPOINT)
+			col_cache_push(cc, scan - last_eol, res);
 	}
 
 	return res;
@@ -483,47 +740,21 @@ grapheme_column(Buffer *buf, gbuf_offs ofs)
 gbuf_offs
 marker_offs(Buffer *buf, const BufferMarker *marker)
 {
-	return (marker->rtol * gbuf_len(&buf->gbuf)) + marker->offset;
+	return marker->offset;
 }
 
-static bool
-traverse(Buffer *buf, BufferMarker *marker)
+int
+marker_line(Buffer *buf, const BufferMarker *marker)
 {
-	gbuf_offs hi_ofs = buf_high_selection(buf)->offset;
-
-	if (marker->rtol == 0
-	 && marker->offset > hi_ofs
-	 && rb_tree_find(buf->lo_markers, marker) == marker)
-	{
-		/* A traversal is needed.
-		 * Note that `marker' is guaranteed to be left-to-right,
-		 * because it's in lo_markers */
-
-		rb_tree_remove(buf->lo_markers, marker);
-		marker->rtol = 1;
-		marker->offset -= gbuf_len(&buf->gbuf);
-		marker->line -= buf->lines;
-		rb_tree_insert(buf->hi_markers, marker);
-
-		return true;
-	}
-
-	if (marker->rtol == 1
-	 && marker->offset < hi_ofs
-	 && rb_tree_find(buf->hi_markers, marker) == marker)
-	{
-		/* `marker' is right-to-left */
-
-		rb_tree_remove(buf->hi_markers, marker);
-		marker->rtol = 0;
-		marker->offset += gbuf_len(&buf->gbuf);
-		marker->line += buf->lines;
-		rb_tree_insert(buf->lo_markers, marker);
-
-		return true;
-	}
+	return marker->line;
+}
 
-	return false;
+static void
+marker_set(BufferMarker *marker, gbuf_offs offs, int line, int col)
+{
+	marker->offset = offs;
+	marker->line = line;
+	marker->col = col;
 }
 
 int
@@ -551,8 +782,6 @@ marker_next(Buffer *buf, const char **str, size_t *size, BufferMarker *marker)
 	if (size)
 		*size = len;
 
-	traverse(buf, marker);
-
 	return 0;
 }
 
@@ -579,46 +808,49 @@ marker_prev(Buffer *buf, const char **str, size_t *size, BufferMarker *marker)
 	if (size)
 		*size = len;
 
-	traverse(buf, marker);
-
 	return 0;
 }
 
+void
+marker_goto_line(Buffer *buf, BufferMarker *res, int line)
+{
+	if (line < 1)
+		line = 1;
+	if (line > buf->lines)
+		line = buf->lines;
+
+	gbuf_offs ofs = lidx_line_start(&buf->line_idx, line);
+	marker_set(res, ofs, line, 1);
+}
+
 void
 marker_next_line(Buffer *buf, BufferMarker *res)
 {
-	const char *str;
-	size_t len;
+	int line = marker_line(buf, res);
+	if (line < buf->lines) {
+		marker_goto_line(buf, res, line + 1);
+		return;
+	}
 
-	while (marker_next(buf, &str, &len, res) == 0)
-		if (grapheme_is_newline(str, len))
-			break;
+	/* no next line: go to end of buffer instead */
+	marker_end_of_line(buf, res);
 }
 
 void
 marker_start_of_line(Buffer *buf, BufferMarker *res)
 {
-	const char *str;
-	size_t len;
-
-	do {
-		if (res->col == 1)
-			break;
-	} while (marker_prev(buf, &str, &len, res) == 0);
+	marker_goto_line(buf, res, marker_line(buf, res));
 }
 
 void
 marker_end_of_line(Buffer *buf, BufferMarker *res)
 {
-	const char *str;
-	size_t len;
+	int line = marker_line(buf, res);
+	gbuf_offs ofs = lidx_line_end(&buf->line_idx, &buf->gbuf, line);
+	if (ofs == marker_offs(buf, res))
+		return;
 
-	while (marker_next(buf, &str, &len, res) == 0) {
-		if (grapheme_is_newline(str, len)) {
-			marker_prev(buf, &str, &len, res);
-			break;
-		}
-	}
+	marker_set(res, ofs, line, grapheme_column(buf, ofs));
 }
 
 void
@@ -633,8 +865,52 @@ marker_sort_pair(BufferMarker *a, BufferMarker *b, BufferMarker **left, BufferMa
 	}
 }
 
+static void
+sel_delete(Buffer *buf, const void *arg)
+{
+	BufferMarker *left, *right;
+	marker_sort_pair(&buf->sel_start, &buf->sel_finish, &left, &right);
+
+	buf_notify_delete(buf, left, right);
+	buf_delete_selection_no_notify(buf);
+}
+
 void
 buf_delete_selection(Buffer *buf)
+{
+	buf_each_selection(buf, sel_delete, NULL);
+}
+
+static void
+buf_notify_delete(Buffer *buf, const BufferMarker *left, const BufferMarker *right)
+{
+	gbuf_offs lofs = marker_offs(buf, left);
+	size_t len = marker_offs(buf, right) - lofs;
+
+	/* this makes the text contiguous, unless it's in a piece table */
+	gbuf_move_cursor(&buf->gbuf, lofs);
+
+	size_t run;
+	const char *text = gbuf_get_run(&buf->gbuf, lofs, &run);
+
+	/* ordinary keystrokes delete a grapheme or so, which fits on the
+	 * stack */
+	char small[256];
+	char *copy = NULL;
+	if (run < len) {
+		copy = len <= sizeof(small) ? small : malloc(len);
+		gbuf_strcpy(&buf->gbuf, copy, lofs, len);
+		text = copy;
+	}
+
+	notify_delete(buf->present, left->offset, right->offset, text);
+
+	if (copy != small)
+		free(copy);
+}
+
+static void
+buf_delete_selection_no_notify(Buffer *buf)
 {
 	BufferMarker *left, *right;
 	marker_sort_pair(&buf->sel_start, &buf->sel_finish, &left, &right);
@@ -642,76 +918,182 @@ buf_delete_selection(Buffer *buf)
 	gbuf_offs lofs = marker_offs(buf, left);
 	gbuf_offs rofs = marker_offs(buf, right);
 
-	gbuf_move_cursor(&buf->gbuf, lofs);
+	gbuf_delete_text(&buf->gbuf, lofs, rofs - lofs);
+	buf_lines_changed(buf, lofs, rofs - lofs, 0);
+
+	buf->sel_finish = *left;
+	buf->sel_start = *left;
+}
+
+void
+buf_commit(Buffer *buf)
+{
+	if (buf->batch) {
+		buf->batch_commit = true;
+		return;
+	}
+
+	commit(&buf->present);
+	journal_commit(&buf->journal);
+}
+
+void
+buf_begin_batch(Buffer *buf)
+{
+	++buf->batch;
+}
+
+void
+buf_end_batch(Buffer *buf)
+{
+	if (--buf->batch)
+		return;
+
+	if (buf->batch_from >= 0) {
+		int last_line = lidx_line_of(&buf->line_idx, buf->batch_until, NULL);
+		marks_update_cols(buf, buf->batch_from, last_line);
+		buf->batch_from = -1;
+	}
+
+	if (buf->batch_commit) {
+		buf->batch_commit = false;
+		commit(&buf->present);
+		journal_commit(&buf->journal);
+	}
+}
+
+/*
+ * Marker at `offs'; the undo history only keeps offsets.
+ */
+static BufferMarker
+marker_at(Buffer *buf, gbuf_offs offs)
+{
+	BufferMarker res;
+	marker_set(&res, offs,
+	           lidx_line_of(&buf->line_idx, offs, NULL),
+	           grapheme_column(buf, offs));
+	return res;
+}
+
+/*
+ * Changes replayed by undo and redo go straight to the gap buffer, the
+ * line index and the marks, without walking the text to keep the
+ * selection up to date. Only the range of the last change is kept, and
+ * selected once all changes are made. The undo tree checks that the
+ * changes fit in the text before making any.
+ */
+struct replay {
+	Buffer *buf;
+	gbuf_offs from, until;
+};
+
+static void
+adder(long offset, const char *text, size_t len, void *udata)
+{
+	struct replay *r = udata;
 
-	size_t bytes_removed = rofs - lofs;
-	const char *removed_text = gbuf_get(&buf->gbuf, rofs) - bytes_removed;
-	notify_delete(buf->present,
-	              marker_to_change_pos(left),
-	              marker_to_change_pos(right),
-	              removed_text);
+	gbuf_insert_text(&r->buf->gbuf, offset, text, len);
+	buf_lines_changed(r->buf, offset, 0, len);
 
-	buf_delete_selection_no_notify(buf);
+	r->from = offset;
+	r->until = offset + len;
 }
 
 static void
-buf_delete_selection_no_notify(Buffer *buf)
+deleter(long offset, size_t len, char *copy_here, void *udata)
 {
-	buf_clear_sel_of_markers(buf);
+	struct replay *r = udata;
 
-	int newlines_removed = buf_count_sel_newlines(buf);
+	if (copy_here)
+		gbuf_strcpy(&r->buf->gbuf, copy_here, offset, len);
+	gbuf_delete_text(&r->buf->gbuf, offset, len);
+	buf_lines_changed(r->buf, offset, len, 0);
 
-	BufferMarker *left, *right;
-	marker_sort_pair(&buf->sel_start, &buf->sel_finish, &left, &right);
+	r->from = r->until = offset;
+}
 
-	gbuf_offs lofs = marker_offs(buf, left);
-	gbuf_offs rofs = marker_offs(buf, right);
+static void
+reader(long offset, size_t len, char *copy_here, void *udata)
+{
+	struct replay *r = udata;
 
-	gbuf_delete_text(&buf->gbuf, lofs, rofs - lofs);
+	gbuf_strcpy(&r->buf->gbuf, copy_here, offset, len);
+}
 
-	buf->sel_finish = *left;
-	buf->sel_start = *left;
+static void
+replay_begin(struct replay *r, Buffer *buf)
+{
+	r->buf = buf;
+	r->from = -1;
+	buf_begin_batch(buf);
+}
 
-	buf->lines -= newlines_removed;
+static void
+replay_end(struct replay *r)
+{
+	if (r->from >= 0) {
+		BufferMarker from_mk = marker_at(r->buf, r->from);
+		BufferMarker until_mk = r->until == r->from ? from_mk : marker_at(r->buf, r->until);
+		buf_set_sel(r->buf, &from_mk, &until_mk);
+	}
 
-	buf_recalc_hi_marker_cols(buf);
+	buf_end_batch(r->buf);
+	journal_commit(&r->buf->journal);
 }
 
-void
-buf_commit(Buffer *buf)
+/*
+ * Changes made again from the journal. They become undo steps of their
+ * own, like the changes that were lost.
+ */
+static void
+journal_adder(long offset, const char *text, size_t len, void *udata)
 {
-	commit(&buf->present);
+	Buffer *buf = udata;
+	if (offset < 0 || offset > (long)gbuf_len(&buf->gbuf))
+		return;
+
+	gbuf_insert_text(&buf->gbuf, offset, text, len);
+	buf_lines_changed(buf, offset, 0, len);
+	notify_add(buf->present, offset, offset + len);
 }
 
 static void
-adder(ChangePos from, ChangePos until, const char *text, void *udata)
+journal_deleter(long offset, size_t len, char *copy_here, void *udata)
 {
 	Buffer *buf = udata;
+	if (offset < 0 || offset + len > gbuf_len(&buf->gbuf))
+		return;
 
-	BufferMarker from_mk = marker_from_change_pos(from);
-
-	buf_set_sel(buf, &from_mk, &from_mk);
-	buf_insert_text_no_notify(buf, text, until.offset - from_mk.offset);
-	buf_set_sel(buf, &from_mk, NULL);
+	BufferMarker left = marker_at(buf, offset);
+	BufferMarker right = marker_at(buf, offset + len);
+	buf_notify_delete(buf, &left, &right);
+	gbuf_delete_text(&buf->gbuf, offset, len);
+	buf_lines_changed(buf, offset, len, 0);
 }
 
 static void
-deleter(ChangePos from, ChangePos until, char *copy_here, void *udata)
+journal_end_group(void *udata)
 {
 	Buffer *buf = udata;
+	commit(&buf->present);
+}
 
-	BufferMarker from_mk = marker_from_change_pos(from);
-	BufferMarker until_mk = marker_from_change_pos(until);
-
-	buf_set_sel(buf, &from_mk, &until_mk);
-	gbuf_strcpy(&buf->gbuf, copy_here, from.offset, until.offset - from.offset);
-	buf_delete_selection_no_notify(buf);
+static void
+buf_journal_open(Buffer *buf)
+{
+	buf_begin_batch(buf);
+	journal_open(&buf->journal, buf->filename,
+	             journal_adder, journal_deleter, journal_end_group, buf);
+	buf_end_batch(buf);
 }
 
 void
 buf_undo(Buffer *buf)
 {
-	undo(buf->present, adder, deleter, buf);
+	struct replay r;
+	replay_begin(&r, buf);
+	undo(buf->present, gbuf_len(&buf->gbuf), adder, deleter, &r);
+	replay_end(&r);
 }
 
 void
@@ -720,12 +1102,58 @@ buf_dumb_redo(Buffer *buf)
 	if (!buf->present->past->futures)
 		return;
 
-	redo(buf->present, buf->present->past->futures, adder, deleter, buf);
+	struct replay r;
+	replay_begin(&r, buf);
+	redo(buf->present, buf->present->past->futures, gbuf_len(&buf->gbuf), adder, deleter, &r);
+	replay_end(&r);
+}
+
+static void
+buf_goto_history(Buffer *buf, UndoTree *target)
+{
+	struct replay r;
+	replay_begin(&r, buf);
+	undo_tree_goto(buf->present, target, gbuf_len(&buf->gbuf), adder, deleter, reader, &r);
+	replay_end(&r);
 }
 
 void
-buf_move_cursor(Buffer *buf, int delta, bool extend)
+buf_undo_steps(Buffer *buf, int steps)
+{
+	UndoTree *target = buf->present->past;
+	for (int i = 0; i < steps && target->past; ++i)
+		target = target->past;
+
+	buf_goto_history(buf, target);
+}
+
+void
+buf_redo_steps(Buffer *buf, int steps)
+{
+	UndoTree *target = buf->present->past;
+	for (int i = 0; i < steps && target->futures; ++i)
+		target = target->futures;
+
+	buf_goto_history(buf, target);
+}
+
+void
+buf_goto_time(Buffer *buf, time_t when)
 {
+	buf_goto_history(buf, undo_tree_at_time(buf->present, when));
+}
+
+struct move {
+	int delta;
+	bool extend;
+};
+
+static void
+sel_move_cursor(Buffer *buf, const void *arg)
+{
+	const struct move *mv = arg;
+	int delta = mv->delta;
+
 	BufferMarker start = buf->sel_start;
 	BufferMarker finish = buf->sel_finish;
 
@@ -742,69 +1170,279 @@ buf_move_cursor(Buffer *buf, int delta, bool extend)
 				break;
 	}
 
-	if (!extend)
+	if (!mv->extend)
 		start = finish;
 
 	buf_set_sel(buf, &start, &finish);
 }
 
 void
-buf_set_sel(Buffer *buf, const BufferMarker *start, const BufferMarker *finish)
+buf_move_cursor(Buffer *buf, int delta, bool extend)
 {
-	long prev_hi_offs = buf_high_selection(buf)->offset;
+	struct move mv = { delta, extend };
+	buf_each_selection(buf, sel_move_cursor, &mv);
+}
 
+void
+buf_set_sel(Buffer *buf, const BufferMarker *start, const BufferMarker *finish)
+{
 	if (start)
 		buf->sel_start = *start;
 
 	if (finish)
 		buf->sel_finish = *finish;
+}
+
+static void
+sel_place(Buffer *buf, Selection *sel, const BufferMarker *start, const BufferMarker *finish)
+{
+	mtree_insert(&buf->marks, &sel->start, start->offset, start->line);
+	sel->start.col = start->col;
+	mtree_insert(&buf->marks, &sel->finish, finish->offset, finish->line);
+	sel->finish.col = finish->col;
+}
+
+static void
+sel_unplace(Buffer *buf, Selection *sel)
+{
+	mtree_remove(&buf->marks, &sel->start);
+	mtree_remove(&buf->marks, &sel->finish);
+}
+
+static void
+sel_sort_pair(Selection *sel, Mark **left, Mark **right)
+{
+	if (mark_offset(&sel->start) <= mark_offset(&sel->finish)) {
+		*left = &sel->start;
+		*right = &sel->finish;
+	} else {
+		*left = &sel->finish;
+		*right = &sel->start;
+	}
+}
 
-	/* THIS IS WHERE MARKER TRAVERSALS HAPPEN!
-	 * that is: markers going from lo to hi or hi to lo */
+static gbuf_offs
+sel_low(Selection *sel)
+{
+	Mark *left, *right;
+	sel_sort_pair(sel, &left, &right);
+	return mark_offset(left);
+}
 
-	BufferMarker *hi = buf_high_selection(buf);
-	long new_hi_offs = hi->offset;
+/*
+ * Link `sel' into `buf->sels', behind the selections that start after
+ * it.
+ */
+static void
+sel_link(Buffer *buf, Selection *sel)
+{
+	gbuf_offs low = sel_low(sel);
 
-	if (new_hi_offs > prev_hi_offs) {
+	Selection **link = &buf->sels;
+	while (*link && sel_low(*link) > low)
+		link = &(*link)->next;
 
-		struct rb_iter *it = rb_iter_create();
-		for (;;)
-		{
-			BufferMarker *hi_least = rb_iter_first(it, buf->hi_markers);
-			if (!hi_least)
-				break;
+	sel->next = *link;
+	*link = sel;
+}
 
-			if (!traverse(buf, hi_least))
-				break;
+/*
+ * Merge `b' into `a', where `a' starts first. `a' keeps its
+ * direction.
+ */
+static void
+sel_merge(Buffer *buf, Selection *a, Selection *b)
+{
+	Mark *a_left, *a_right, *b_left, *b_right;
+	sel_sort_pair(a, &a_left, &a_right);
+	sel_sort_pair(b, &b_left, &b_right);
+
+	BufferMarker left = marker_from_mark(a_left);
+	BufferMarker right = marker_from_mark(a_right);
+	if (mark_offset(b_right) > right.offset)
+		right = marker_from_mark(b_right);
+
+	sel_unplace(buf, a);
+	if (a_left == &a->start)
+		sel_place(buf, a, &left, &right);
+	else
+		sel_place(buf, a, &right, &left);
+}
+
+static void
+sels_tidy(Buffer *buf, Selection *primary)
+{
+	/* edits keep the order of the marks, but moving the cursors may
+	 * not, so sort again. Selections that are in order are appended
+	 * directly, which keeps this linear for a sorted list. */
+	Selection *sels = buf->sels;
+	Selection *tail = NULL;
+	buf->sels = NULL;
+	while (sels) {
+		Selection *sel = sels;
+		sels = sel->next;
+
+		if (tail && sel_low(tail) >= sel_low(sel)) {
+			sel->next = NULL;
+			tail->next = sel;
+			tail = sel;
+			continue;
 		}
 
-		rb_iter_dealloc(it);
+		sel_link(buf, sel);
+		if (!sel->next)
+			tail = sel;
+	}
+
+	/* cursors at the same place, or selections that overlap, become
+	 * one, which is the primary selection if it's one of them */
+	Selection **link = &buf->sels;
+	while ((*link)->next) {
+		Selection *sel = *link;
+		Selection *prev = sel->next; /* before `sel' in the text */
+
+		Mark *left, *right;
+		sel_sort_pair(prev, &left, &right);
+		gbuf_offs low = sel_low(sel);
+		if (low >= mark_offset(right) && low != mark_offset(left)) {
+			link = &sel->next;
+			continue;
+		}
 
-	} else if (new_hi_offs < prev_hi_offs) {
+		sel_merge(buf, prev, sel);
 
-		struct rb_iter *it = rb_iter_create();
-		for (;;)
-		{
-			BufferMarker *lo_last = rb_iter_first(it, buf->lo_markers);
-			if (!lo_last)
-				break;
+		Selection *drop = sel;
+		if (sel == primary) {
+			BufferMarker start = marker_from_mark(&prev->start);
+			BufferMarker finish = marker_from_mark(&prev->finish);
+			sel_unplace(buf, primary);
+			sel_place(buf, primary, &start, &finish);
 
-			if (!traverse(buf, lo_last))
-				break;
+			primary->next = prev->next;
+			drop = prev;
+		} else {
+			*link = prev;
 		}
 
-		rb_iter_dealloc(it);
+		sel_unplace(buf, drop);
+		free(drop);
+	}
+}
+
+static void
+sels_add_primary(Buffer *buf, Selection *primary)
+{
+	primary->start.right_gravity = primary->finish.right_gravity = false;
+	sel_place(buf, primary, &buf->sel_start, &buf->sel_finish);
+	sel_link(buf, primary);
+
+	sels_tidy(buf, primary);
+}
+
+static void
+sels_remove_primary(Buffer *buf, Selection *primary)
+{
+	sels_tidy(buf, primary);
+
+	buf->sel_start = marker_from_mark(&primary->start);
+	buf->sel_finish = marker_from_mark(&primary->finish);
+
+	Selection **link = &buf->sels;
+	while (*link != primary)
+		link = &(*link)->next;
+	*link = primary->next;
+
+	sel_unplace(buf, primary);
+}
+
+static void
+buf_each_selection(Buffer *buf, sel_edit edit, const void *arg)
+{
+	if (!buf->sels) {
+		edit(buf, arg);
+		return;
+	}
+
+	Selection primary;
+	sels_add_primary(buf, &primary);
+
+	/* an edit only changes the columns of the selections after it,
+	 * which have been edited already, so those can wait until all
+	 * are done */
+	buf_begin_batch(buf);
+	for (Selection *sel = buf->sels; sel; sel = sel->next) {
+		buf->sel_start = marker_from_mark(&sel->start);
+		buf->sel_finish = marker_from_mark(&sel->finish);
+
+		edit(buf, arg);
+
+		sel_unplace(buf, sel);
+		sel_place(buf, sel, &buf->sel_start, &buf->sel_finish);
+	}
+	buf_end_batch(buf);
+
+	sels_remove_primary(buf, &primary);
+}
+
+/*
+ * Move `marker' right along its line, up to column `col'.
+ */
+static void
+marker_to_col(Buffer *buf, BufferMarker *marker, int col)
+{
+	while (marker->col < col) {
+		BufferMarker next = *marker;
+		const char *str;
+		size_t len;
+		if (marker_next(buf, &str, &len, &next) == -1)
+			return;
+
+		if (grapheme_is_newline(str, len) || next.col > col)
+			return;
+
+		*marker = next;
 	}
 }
 
 void
-buf_pipe_selection(Buffer *buf, const char *str)
+buf_add_selection_below(Buffer *buf)
 {
-	commit(&buf->present);
+	BufferMarker below = buf->sel_finish;
+	if (below.line >= buf->lines)
+		return;
+
+	marker_goto_line(buf, &below, below.line + 1);
+	marker_to_col(buf, &below, buf->sel_finish.col);
+
+	Selection *sel = malloc(sizeof(Selection));
+	if (!sel)
+		return;
+
+	sel->start.right_gravity = sel->finish.right_gravity = false;
+	sel_place(buf, sel, &buf->sel_start, &buf->sel_finish);
+	sel_link(buf, sel);
 
-	buf_clear_sel_of_markers(buf);
+	/* if this puts the cursor on top of another selection, the two
+	 * are merged by the next edit */
+	buf_set_sel(buf, &below, &below);
+}
+
+void
+buf_clear_selections(Buffer *buf)
+{
+	while (buf->sels) {
+		Selection *sel = buf->sels;
+		buf->sels = sel->next;
 
-	int pre_pipe_newlines = buf_count_sel_newlines(buf);
+		sel_unplace(buf, sel);
+		free(sel);
+	}
+}
+
+void
+buf_pipe_selection(Buffer *buf, const char *str)
+{
+	commit(&buf->present);
 
 	BufferMarker *left, *right;
 	marker_sort_pair(&buf->sel_start, &buf->sel_finish, &left, &right);
@@ -812,14 +1450,7 @@ buf_pipe_selection(Buffer *buf, const char *str)
 	gbuf_offs start = left->offset;
 	gbuf_offs stop = right->offset;
 
-	gbuf_move_cursor(&buf->gbuf, start);
-
-	size_t bytes_replaced = stop - start;
-	const char *text_replaced = gbuf_get(&buf->gbuf, stop) - bytes_replaced;
-	notify_delete(buf->present,
-	              marker_to_change_pos(left),
-	              marker_to_change_pos(right),
-	              text_replaced);
+	buf_notify_delete(buf, left, right);
 
 	int old_size = gbuf_len(&buf->gbuf);
 
@@ -853,24 +1484,21 @@ buf_pipe_selection(Buffer *buf, const char *str)
 	int delta_size = new_size - old_size;
 	gbuf_offs new_finish_ofs = stop + delta_size;
 
+	buf_lines_changed(buf, start, stop - start, new_finish_ofs - start);
+
 	/* the selection should now be devoid of other markers, so
 	 * the following is valid */
 
 	*right = *left;
+	marker_set(right,
+	           new_finish_ofs,
+	           lidx_line_of(&buf->line_idx, new_finish_ofs, NULL),
+	           grapheme_column(buf, new_finish_ofs));
 
-	while (right->offset != new_finish_ofs)
-		if (marker_next(buf, NULL, NULL, right) == -1)
-			break;
-
-	notify_add(buf->present,
-	           marker_to_change_pos(left),
-	           marker_to_change_pos(right));
-
-	int post_pipe_newlines = buf_count_sel_newlines(buf);
-
-	buf->lines += post_pipe_newlines - pre_pipe_newlines;
+	notify_add(buf->present, left->offset, right->offset);
 
 	commit(&buf->present);
+	journal_commit(&buf->journal);
 }
 
 BufferMarker *
@@ -882,108 +1510,82 @@ buf_high_selection(Buffer *buf)
 	return &buf->sel_finish;
 }
 
+struct text {
+	const char *str;
+	size_t len;
+};
+
 static void
-buf_clear_sel_of_markers(Buffer *buf)
+sel_insert_text(Buffer *buf, const void *arg)
 {
-	BufferMarker *left, *right;
-	marker_sort_pair(&buf->sel_start, &buf->sel_finish, &left, &right);
-
-	struct rb_iter *it = rb_iter_create();
-	for (;;) {
-		BufferMarker *lo_last = rb_iter_last(it, buf->lo_markers);
-
-		/* shouldn't really happen (buf_start), buf whatever */
-		if (!lo_last)
-			break;
+	const struct text *text = arg;
 
-		/* if (lo_last <= left) */
-		if (cmp_buffer_markers(lo_last, left) <= 0)
-			break;
+	if (!buf_is_selection_degenerate(buf))
+		return;
 
-		rb_tree_remove(buf->lo_markers, lo_last);
-		*lo_last = *left; /* set to same location as left */
-		rb_tree_insert(buf->lo_markers, lo_last);
-	}
+	BufferMarker prev_finish = buf->sel_finish;
+	buf_insert_text_no_notify(buf, text->str, text->len);
+	BufferMarker new_finish = buf->sel_finish;
 
-	rb_iter_dealloc(it);
+	notify_add(buf->present, prev_finish.offset, new_finish.offset);
 }
 
-void
-buf_insert_input_string(Buffer *buf, const char *input, size_t len)
+static void
+sel_insert_input_string(Buffer *buf, const void *arg)
 {
+	struct text text = *(const struct text *)arg;
+
 	if (!buf_is_selection_degenerate(buf))
 		return;
 
-	if (len > 0 && input[0] == '\t') {
+	if (text.len > 0 && text.str[0] == '\t') {
 		int indent = buf->werk->cfg.text.indentation;
 		for (int i = 0; i < indent; ++i)
-			buf_insert_text(buf, " ", 1);
+			sel_insert_text(buf, &(struct text){ " ", 1 });
 
 		if (indent)
-			++input; /* skip tab character */
+			++text.str; /* skip tab character */
 	}
 
-	buf_insert_text(buf, input, len);
+	sel_insert_text(buf, &text);
 }
 
 void
-buf_insert_text(Buffer *buf, const char *input, size_t len)
+buf_insert_input_string(Buffer *buf, const char *input, size_t len)
 {
-	if (!buf_is_selection_degenerate(buf))
-		return;
-
-	BufferMarker prev_finish = buf->sel_finish;
-	buf_insert_text_no_notify(buf, input, len);
-	BufferMarker new_finish = buf->sel_finish;
+	struct text text = { input, len };
+	buf_each_selection(buf, sel_insert_input_string, &text);
+}
 
-	notify_add(buf->present,
-	           marker_to_change_pos(&prev_finish),
-	           marker_to_change_pos(&new_finish));
+void
+buf_insert_text(Buffer *buf, const char *input, size_t len)
+{
+	struct text text = { input, len };
+	buf_each_selection(buf, sel_insert_text, &text);
 }
 
 static void
 buf_insert_text_no_notify(Buffer *buf, const char *input, size_t len)
 {
-	/* NOTE 1: a buf_insert_text() never causes _any_ marker
-	 * traversals (a marker going from hi to lo or vice versa) */
-
 	if (!buf_is_selection_degenerate(buf))
 		return;
 
-	/* sel_finish is always left-to-right, so this is valid */
-	gbuf_insert_text(&buf->gbuf, buf->sel_finish.offset, input, len);
-
-	for (const char *stop = input + len;
-	     input != stop;
-	     input = u8_grapheme_next(input, stop))
-	{
-		/* expand selection so we can count added newlines */
-		buf_move_cursor(buf, 1, true);
-	}
-
-	int added_newlines = buf_count_sel_newlines(buf);
-	buf->lines += added_newlines;
-
-	/* make selection degenerate */
-	buf_move_cursor(buf, 0, false);
-
-	buf_recalc_hi_marker_cols(buf);
-}
-
-static void
-buf_recalc_hi_marker_cols(Buffer *buf)
-{
-	int rtol_sel_finish_line = buf->sel_finish.line - buf->lines;
+	gbuf_offs ofs = buf->sel_finish.offset;
+	gbuf_insert_text(&buf->gbuf, ofs, input, len);
+	buf_lines_changed(buf, ofs, 0, len);
 
-	struct rb_iter *it = rb_iter_create();
-	for (BufferMarker *m = rb_iter_first(it, buf->hi_markers);
-	     m && m->line == rtol_sel_finish_line;
-	     m = rb_iter_next(it))
-	{
-		m->col = grapheme_column(buf, marker_offs(buf, m));
-	}
+	/* The marks have already moved along with the text. Only the
+	 * selection needs updating, which takes a single pass over the
+	 * input. */
+	BufferMarker finish = buf->sel_finish;
+	finish.offset += len;
+	finish.line = lidx_line_of(&buf->line_idx, finish.offset, NULL);
+	finish.col = advance_column(input,
+	                            len,
+	                            buf->sel_finish.col,
+	                            buf->werk->cfg.editor.tab_width);
 
-	rb_iter_dealloc(it);
+	buf_set_sel(buf, &finish, &finish);
 }
 
 static void
@@ -1005,24 +1607,18 @@ buf_calc_vp_origin(Buffer *buf, int wlines, int hlines)
 	else if (dorig_col >= vw)
 		buf->vp_orig_col += (dorig_col - vw);
 
-	if (dorig_line < 0) {
-		BufferMarker new_orig = buf->sel_finish;
-		marker_start_of_line(buf, &new_orig);
+	if (dorig_line < 0)
+		buf->vp_orig_line = marker.line;
+	else if (dorig_line >= vh)
+		buf->vp_orig_line = marker.line - (vh - 1);
 
-		buf->vp_orig_line = new_orig.line;
-		buf->vp_first_line = new_orig.offset;
-	} else if (dorig_line >= vh) {
-		BufferMarker new_orig = buf->sel_finish;
-		marker_start_of_line(buf, &new_orig);
-
-		for (int i = 0; i < vh - 1; ++i) {
-			marker_prev(buf, NULL, NULL, &new_orig);
-			marker_start_of_line(buf, &new_orig);
-		}
+	if (buf->vp_orig_line > buf->lines)
+		buf->vp_orig_line = buf->lines;
+	if (buf->vp_orig_line < 1)
+		buf->vp_orig_line = 1;
 
-		buf->vp_orig_line = new_orig.line;
-		buf->vp_first_line = new_orig.offset;
-	}
+	/* also keeps vp_first_line valid when text above it is edited */
+	buf->vp_first_line = lidx_line_start(&buf->line_idx, buf->vp_orig_line);
 }
 
 /*
@@ -1161,13 +1757,15 @@ buf_draw_line(Buffer *buf,
 }
 
 static void
-buf_draw_selection(Buffer *buf, Drawer *d, int vw, int vh, int offset_x)
-{
-	if (buf_is_selection_degenerate(buf))
-		return;
-
-	BufferMarker left = buf->sel_start;
-	BufferMarker right = buf->sel_finish;
+buf_draw_selection(Buffer *buf,
+                   Drawer *d,
+                   BufferMarker start,
+                   BufferMarker finish,
+                   int vw, int vh,
+                   int offset_x)
+{
+	BufferMarker left = start;
+	BufferMarker right = finish;
 	if (left.offset > right.offset) {
 		BufferMarker temp = right;
 		right = left;
@@ -1178,7 +1776,8 @@ buf_draw_selection(Buffer *buf, Drawer *d, int vw, int vh, int offset_x)
 
 		int y = left.line - buf->vp_orig_line;
 		int x = left.col - buf->vp_orig_col + offset_x;
-		drw_fill_rect(d, x, y, right.col - left.col, 1);
+		int w = right.col - left.col;
+		drw_fill_rect(d, x, y, w ? w : 1, 1);
 
 	} else {
 
@@ -1219,7 +1818,19 @@ buf_draw(Buffer *buf, Drawer *d, int wlines, int hlines)
 	}
 
 	drw_set_color(d, buf->mode->colors.sel);
-	buf_draw_selection(buf, d, vw, vh, line_num_width);
+	if (!buf_is_selection_degenerate(buf))
+		buf_draw_selection(buf, d, buf->sel_start, buf->sel_finish, vw, vh, line_num_width);
+
+	for (Selection *sel = buf->sels; sel; sel = sel->next) {
+		BufferMarker start = marker_from_mark(&sel->start);
+		BufferMarker finish = marker_from_mark(&sel->finish);
+		if (start.line >= line_num + vh && finish.line >= line_num + vh)
+			continue;
+		if (start.line < line_num && finish.line < line_num)
+			break;
+
+		buf_draw_selection(buf, d, start, finish, vw, vh, line_num_width);
+	}
 
 	/* draw lines */
 
@@ -1304,13 +1915,51 @@ buf_save(Buffer *buf)
 	if (!buf->filename)
 		return -1;
 
+	/* the saved text is a step of its own in the saved history */
+	buf_commit(buf);
+
+	if (buf->gbuf.pt)
+		return buf_save_by_rename(buf);
+
 	FILE *out = fopen(buf->filename, "wb");
 	if (!out)
 		return -1;
 
 	gbuf_write(&buf->gbuf, out);
-	fclose(out);
+	if (fclose(out))
+		return -1;
+
+	journal_reset(&buf->journal, buf->filename);
+	buf_save_history(buf);
+	return 0;
+}
+
+static int
+buf_save_by_rename(Buffer *buf)
+{
+	static const char suffix[] = ".werk-save";
+	size_t filename_len = strlen(buf->filename);
+	char tmp_name[filename_len + sizeof(suffix)];
+	memcpy(tmp_name, buf->filename, filename_len);
+	memcpy(tmp_name + filename_len, suffix, sizeof(suffix));
+
+	FILE *out = fopen(tmp_name, "wb");
+	if (!out)
+		return -1;
+
+	/* keep permissions of the original file */
+	struct stat st;
+	if (!stat(buf->filename, &st))
+		fchmod(fileno(out), st.st_mode & 07777);
+
+	gbuf_write(&buf->gbuf, out);
+	if (fclose(out) || rename(tmp_name, buf->filename)) {
+		remove(tmp_name);
+		return -1;
+	}
 
+	journal_reset(&buf->journal, buf->filename);
+	buf_save_history(buf);
 	return 0;
 }
 
@@ -1331,7 +1980,7 @@ static void
 cmd_dialog_on_enter_press(Buffer *buf, KeyMods mods)
 {
 	GapBuf *gbuf = &buf->dialog.gbuf;
-	const size_t buf_len = gbuf->size - gbuf->gap_size;
+	const size_t buf_len = gbuf_len(gbuf);
 	char *str = calloc(1, buf_len + 1);
 	gbuf_strcpy(gbuf, str, 0, buf_len);
 	buf_pipe_selection(buf, str);
@@ -1355,7 +2004,14 @@ total_string_width(const char *str, size_t len, int tab_width)
 	const char *stop = str + len;
 
 	while (str != stop) {
-		const char *nxt = u8_grapheme_next(str, stop);
+		size_t plain = plain_prefix(str, stop - str, false);
+		if (plain) {
+			width += plain;
+			str += plain;
+			continue;
+		}
+
+		const char *nxt = grapheme_next_fast(str, stop);
 		width += grapheme_width(str, nxt - str, width + 1, tab_width);
 		str = nxt;
 	}
@@ -1393,7 +2049,7 @@ textbox_align_params(const char *str,
 	const char *s = str;
 	int x = 0;
 	while (x < discrepancy) {
-		const char *nxt = u8_grapheme_next(s, str + len);
+		const char *nxt = grapheme_next_fast(s, str + len);
 		size_t bytes = nxt - s;
 		x += grapheme_width(s, bytes, x + 1, tab_width);
 		s = nxt;
@@ -1439,9 +2095,11 @@ draw_cmd_dialog(Buffer *buf, Drawer *d, int ww, int wh)
 
 	GapBuf *gbuf = &buf->dialog.gbuf;
 
-	const size_t buf_len = gbuf->size - gbuf->gap_size;
-	char *str = calloc(1, buf_len + 1);
-	gbuf_strcpy(gbuf, str, 0, buf_len);
+	/* the dialog is only edited at its end, where the gap usually
+	 * is already, so this leaves the text in a single span */
+	const size_t buf_len = gbuf_len(gbuf);
+	gbuf_move_cursor(gbuf, buf_len);
+	const char *str = gbuf_get(gbuf, 0);
 
 	int col_offset, byte_offset, cols_shown;
 	textbox_align_params(str,
@@ -1455,8 +2113,6 @@ draw_cmd_dialog(Buffer *buf, Drawer *d, int ww, int wh)
 
 	drw_draw_text(d, x + col_offset, y, false, false, str + byte_offset, buf_len - byte_offset);
 
-	free(str);
-
 	drw_place_caret(d, x + cols_shown, y, true);
 }
 
@@ -1580,10 +2236,8 @@ werk_add_buffer(WerkInstance *werk)
 {
 	Buffer *buf = malloc(sizeof(Buffer));
 	buf_init(buf, werk);
-	/* This doesn't invalidate buf->buf_end.col (since it's a
-	 * newline) */
 	gbuf_insert_text(&buf->gbuf, 0, buf->eol, buf->eol_size);
-	buf->lines = 2;
+	buf_lines_changed(buf, 0, 0, buf->eol_size);
 
 	Buffer *cur_active = werk->active_buf;
 	if (cur_active) {
@@ -1615,6 +2269,24 @@ werk_add_file(WerkInstance *werk, const char *path)
 	return buf;
 }
 
+/*
+ * Journals are synced together, at most once a tick, however many
+ * changes were made in between.
+ */
+static void
+werk_on_tick(Window *win)
+{
+	WerkInstance *werk = win->user_data;
+	Buffer *buf = werk->active_buf;
+	if (!buf)
+		return;
+
+	do {
+		journal_sync(&buf->journal);
+		buf = buf->next;
+	} while (buf != werk->active_buf);
+}
+
 static void
 werk_on_close(Window *win)
 {
@@ -1646,6 +2318,7 @@ werk_init(Window *win, const char **files, int num_files, ConfigReader *crdr)
 	win->on_backspace_press = werk_on_backspace_press;
 	win->on_delete_press = werk_on_delete_press;
 	win->on_close = werk_on_close;
+	win->on_tick = werk_on_tick;
 
 	win_show(win);
 }
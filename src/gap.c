@@ -8,6 +8,11 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <unigbrk.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
 
 /* for debugging purposes */
 static void
@@ -49,12 +54,13 @@ static size_t
 get_new_size(size_t prev, size_t req)
 {
 	/*
-	 * This resizing strategy grows the buffer by a kibibyte every time
-	 * an upsize is needed, and shrinks the buffer by a kibibyte whenever
-	 * the buffer _could have_ shrunk by two kibibytes.
+	 * This resizing strategy grows the buffer by at least half its size
+	 * every time an upsize is needed, and shrinks it to twice the
+	 * required size once less than a quarter of it is needed.
 	 *
-	 * The shrinking rule ensures that continuously deleting and retyping
-	 * text in the buffer doesn't cause a massive realloc() call each time.
+	 * Either way, the buffer is left half full at worst, so it takes as
+	 * many inserted or deleted bytes as the buffer is long before the
+	 * next resize copies the text again.
 	 */
 
 	const size_t kibi = 1024;
@@ -62,44 +68,144 @@ get_new_size(size_t prev, size_t req)
 	if (prev == 0 && req == 0)
 		return kibi;
 
+	size_t new_size = prev;
 	if (req > prev) {
-		size_t req_kbis = (req - prev + kibi - 1) / kibi;
-		return prev + req_kbis * kibi;
+		new_size = prev + prev / 2;
+		if (new_size < req)
+			new_size = req;
+	} else if (req < prev / 4) {
+		new_size = req * 2;
 	}
 
-	if (req < prev) {
-		size_t left_over_kbis = (prev - req) / kibi;
-		if (left_over_kbis == 0)
-			return prev;
-		size_t shrink_kbis = left_over_kbis - 1;
-		size_t new_size = prev - shrink_kbis * kibi;
-		if (new_size < kibi)
-			new_size = kibi;
-		return new_size;
+	new_size = (new_size + kibi - 1) / kibi * kibi;
+	if (new_size < kibi)
+		new_size = kibi;
+	return new_size;
+}
+
+const GBufPolicy gbuf_default_policy = {
+	.new_size = get_new_size,
+	.map_min = 1 << 20,
+	.huge_min = 32 << 20,
+};
+
+/*
+ * Anonymous mapping of `size' bytes, or NULL.
+ */
+static char *
+map_text(size_t size)
+{
+	void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	return p == MAP_FAILED ? NULL : p;
+}
+
+/*
+ * Resize mapping `start' from `old_size' to `new_size' bytes. On Linux,
+ * this moves page table entries instead of copying the text.
+ */
+static char *
+remap_text(char *start, size_t old_size, size_t new_size)
+{
+#ifdef MREMAP_MAYMOVE
+	void *p = mremap(start, old_size, new_size, MREMAP_MAYMOVE);
+	return p == MAP_FAILED ? NULL : p;
+#else
+	char *p = map_text(new_size);
+	if (p) {
+		memcpy(p, start, old_size < new_size ? old_size : new_size);
+		munmap(start, old_size);
+	}
+	return p;
+#endif
+}
+
+static void
+free_text(GapBuf *buf)
+{
+	if (buf->mapped)
+		munmap(buf->start, buf->size);
+	else
+		free(buf->start);
+}
+
+/*
+ * Reallocate the buffer memory to `new_size' bytes, mapping it or not as
+ * the policy says. The gap is left alone.
+ */
+static int
+realloc_text(GapBuf *buf, size_t new_size)
+{
+	const GBufPolicy *policy = buf->policy;
+	bool map = policy->map_min && new_size >= policy->map_min;
+	char *start;
+
+	if (!map && !buf->mapped) {
+		start = realloc(buf->start, new_size);
+	} else if (map && buf->mapped) {
+		start = remap_text(buf->start, buf->size, new_size);
+	} else {
+		/* switching between malloc() and mmap() */
+		start = map ? map_text(new_size) : malloc(new_size);
+		if (start) {
+			memcpy(start, buf->start, buf->size < new_size ? buf->size : new_size);
+			free_text(buf);
+		}
 	}
 
-	return prev;
+	if (!start)
+		return -1;
+
+	buf->start = start;
+	buf->mapped = map;
+
+#ifdef MADV_HUGEPAGE
+	if (map && policy->huge_min && new_size >= policy->huge_min)
+		madvise(start, new_size, MADV_HUGEPAGE);
+#endif
+
+	return 0;
 }
 
 void
 gbuf_init(GapBuf *buf)
 {
-	size_t bsize = get_new_size(0, 0);
+	buf->policy = &gbuf_default_policy;
+	buf->mapped = false;
+
+	size_t bsize = buf->policy->new_size(0, 0);
 	buf->start = malloc(bsize);
 	buf->gap_offs = 0;
 	buf->size = buf->gap_size = bsize;
+	buf->pt = NULL;
+	buf->ct = NULL;
+	buf->mg = NULL;
 }
 
 void
 gbuf_destroy(GapBuf *buf)
 {
-	free(buf->start);
+	free_text(buf);
+	if (buf->pt)
+		ptab_destroy(buf->pt);
+	if (buf->ct)
+		ctree_destroy(buf->ct);
+	if (buf->mg)
+		mgap_destroy(buf->mg);
+}
+
+void
+gbuf_set_policy(GapBuf *buf, const GBufPolicy *policy)
+{
+	buf->policy = policy;
 }
 
 int
 gbuf_resize(GapBuf *buf, size_t req)
 {
-	size_t new_size = get_new_size(buf->size, req);
+	if (buf->pt || buf->ct || buf->mg)
+		return 0;
+
+	size_t new_size = buf->policy->new_size(buf->size, req);
 	if (new_size == buf->size)
 		return 0;
 
@@ -109,16 +215,18 @@ gbuf_resize(GapBuf *buf, size_t req)
 	size_t new_end_gap_offs = new_size - post_gap_size;
 
 	if (new_size > buf->size) {
-		buf->start = realloc(buf->start, new_size);
-		if (buf->start == NULL)
+		if (realloc_text(buf, new_size))
 			return -1;
 		memmove(buf->start + new_end_gap_offs, buf->start + end_gap_offs, post_gap_size);
 		buf->gap_size += new_size - buf->size;
 	} else if (new_size < buf->size) {
 		memmove(buf->start + new_end_gap_offs, buf->start + end_gap_offs, post_gap_size);
-		buf->start = realloc(buf->start, new_size);
-		if (buf->start == NULL)
+		if (realloc_text(buf, new_size)) {
+			/* keep the old memory, with the text after the gap
+			 * moved back */
+			memmove(buf->start + end_gap_offs, buf->start + new_end_gap_offs, post_gap_size);
 			return -1;
+		}
 		buf->gap_size -= buf->size - new_size;
 	}
 
@@ -144,23 +252,100 @@ gbuf_auto_resize(GapBuf *buf)
 void
 gbuf_clear(GapBuf *gbuf)
 {
+	const GBufPolicy *policy = gbuf->policy;
 	gbuf_destroy(gbuf);
 	gbuf_init(gbuf);
+	gbuf->policy = policy;
 }
 
 void
 gbuf_write(GapBuf *gbuf, FILE *out)
 {
-	fwrite(gbuf->start, gbuf->gap_offs, 1, out);
+	GBufSpanIter it;
+	GBufSpan span;
+	gbuf_spans(&it, gbuf, 0, gbuf_len(gbuf));
+	while (gbuf_span_next(&it, &span))
+		fwrite(span.text, span.len, 1, out);
+}
+
+/*
+ * Free the current text of `gbuf', before switching to other storage.
+ */
+static void
+drop_text(GapBuf *gbuf)
+{
+	gbuf_destroy(gbuf);
+	gbuf->start = NULL;
+	gbuf->mapped = false;
+	gbuf->size = gbuf->gap_size = 0;
+	gbuf->gap_offs = 0;
+	gbuf->pt = NULL;
+	gbuf->ct = NULL;
+	gbuf->mg = NULL;
+}
+
+/*
+ * gbuf_read() for GBUF_STORAGE_PIECE
+ */
+static int
+gbuf_read_pieces(GapBuf *gbuf, FILE *in)
+{
+	PieceTable *pt = ptab_open(in);
+	if (!pt)
+		return -1;
 
-	const char *snd_part = gbuf->start + gbuf->gap_offs + gbuf->gap_size;
-	size_t snd_size = gbuf_len(gbuf) - gbuf->gap_offs;
-	fwrite(snd_part, snd_size, 1, out);
+	drop_text(gbuf);
+	gbuf->pt = pt;
+	return 0;
+}
+
+/*
+ * gbuf_read() for GBUF_STORAGE_CHUNK
+ */
+static int
+gbuf_read_chunks(GapBuf *gbuf, FILE *in)
+{
+	ChunkTree *ct = ctree_read(in);
+	if (!ct)
+		return -1;
+
+	drop_text(gbuf);
+	gbuf->ct = ct;
+	return 0;
+}
+
+/*
+ * gbuf_read() for GBUF_STORAGE_GAPS
+ */
+static int
+gbuf_read_gaps(GapBuf *gbuf, FILE *in)
+{
+	MultiGap *mg = mgap_read(in);
+	if (!mg)
+		return -1;
+
+	drop_text(gbuf);
+	gbuf->mg = mg;
+	return 0;
 }
 
 int
-gbuf_read(GapBuf *gbuf, FILE *in)
+gbuf_read(GapBuf *gbuf, FILE *in, GBufStorage storage)
 {
+	switch (storage) {
+	case GBUF_STORAGE_PIECE:
+		return gbuf_read_pieces(gbuf, in);
+	case GBUF_STORAGE_CHUNK:
+		return gbuf_read_chunks(gbuf, in);
+	case GBUF_STORAGE_GAPS:
+		return gbuf_read_gaps(gbuf, in);
+	default:
+		break;
+	}
+
+	if (gbuf->pt || gbuf->ct || gbuf->mg)
+		gbuf_clear(gbuf);
+
 	if (fseek(in, 0, SEEK_END) < 0) {
 		fprintf(stderr, "error reading buffer: file stream does not support seeking.\n");
 		fprintf(stderr, "are you perhaps trying to open a network stream?\n");
@@ -188,11 +373,6 @@ gbuf_read(GapBuf *gbuf, FILE *in)
 		return -1;
 	}
 
-	if (u8_check(gbuf->start, fsize)) {
-		fprintf(stderr, "error reading buffer: file is not UTF-8.\n");
-		return -1;
-	}
-
 	gbuf->gap_offs = fsize;
 	gbuf->gap_size = gbuf->size - fsize;
 	return 0;
@@ -201,6 +381,19 @@ gbuf_read(GapBuf *gbuf, FILE *in)
 void
 gbuf_insert_text(GapBuf *buf, gbuf_offs cursor, const char *str, size_t len)
 {
+	if (buf->pt) {
+		ptab_insert(buf->pt, cursor, str, len);
+		return;
+	}
+	if (buf->ct) {
+		ctree_insert(buf->ct, cursor, str, len);
+		return;
+	}
+	if (buf->mg) {
+		mgap_insert(buf->mg, cursor, str, len);
+		return;
+	}
+
 	if (len > buf->gap_size)
 		gbuf_resize(buf, buf->size - buf->gap_size + len);
 
@@ -215,9 +408,16 @@ gbuf_backspace_grapheme(GapBuf *buf, gbuf_offs cursor)
 	if (cursor == 0)
 		return;
 
+	if (buf->pt || buf->ct || buf->mg) {
+		gbuf_offs prev = cursor;
+		gbuf_grapheme_prev(buf, NULL, NULL, &prev);
+		gbuf_delete_text(buf, prev, cursor - prev);
+		return;
+	}
+
 	gbuf_move_cursor(buf, cursor);
 	const char *cursor_ptr = buf->start + cursor;
-	const char *goto_ptr = u8_grapheme_prev(cursor_ptr, buf->start);
+	const char *goto_ptr = grapheme_prev_fast(cursor_ptr, buf->start);
 	size_t n = cursor_ptr - goto_ptr;
 	buf->gap_offs -= n;
 	buf->gap_size += n;
@@ -230,9 +430,16 @@ gbuf_delete_grapheme(GapBuf *buf, gbuf_offs cursor)
 	if (cursor >= gbuf_len(buf))
 		return;
 
+	if (buf->pt || buf->ct || buf->mg) {
+		gbuf_offs next = cursor;
+		gbuf_grapheme_next(buf, NULL, NULL, &next);
+		gbuf_delete_text(buf, cursor, next - cursor);
+		return;
+	}
+
 	gbuf_move_cursor(buf, cursor);
 	const char *cursor_stop = buf->start + cursor + buf->gap_size;
-	const char *goto_ptr = u8_grapheme_next(cursor_stop, buf->start + buf->size);
+	const char *goto_ptr = grapheme_next_fast(cursor_stop, buf->start + buf->size);
 	size_t n = goto_ptr - cursor_stop;
 
 	buf->gap_size += n;
@@ -247,6 +454,19 @@ gbuf_delete_text(GapBuf *buf, gbuf_offs cursor, size_t len)
 	if (cursor + len > gbuf_len(buf))
 		len = gbuf_len(buf) - cursor;
 
+	if (buf->pt) {
+		ptab_delete(buf->pt, cursor, len);
+		return;
+	}
+	if (buf->ct) {
+		ctree_delete(buf->ct, cursor, len);
+		return;
+	}
+	if (buf->mg) {
+		mgap_delete(buf->mg, cursor, len);
+		return;
+	}
+
 	gbuf_move_cursor(buf, cursor);
 	buf->gap_size += len;
 	gbuf_auto_resize(buf);
@@ -272,15 +492,159 @@ offs_to_ptr(GapBuf *buf, gbuf_offs offset)
 const char *
 gbuf_get(GapBuf *buf, gbuf_offs offset)
 {
+	if (buf->pt)
+		return ptab_get(buf->pt, offset, NULL);
+	if (buf->ct)
+		return ctree_get(buf->ct, offset, NULL);
+	if (buf->mg)
+		return mgap_get(buf->mg, offset, NULL);
+
 	return offs_to_ptr(buf, offset);
 }
 
+const char *
+gbuf_get_run(GapBuf *buf, gbuf_offs offset, size_t *len)
+{
+	if (buf->pt)
+		return ptab_get(buf->pt, offset, len);
+	if (buf->ct)
+		return ctree_get(buf->ct, offset, len);
+	if (buf->mg)
+		return mgap_get(buf->mg, offset, len);
+
+	if (offset < buf->gap_offs) {
+		*len = buf->gap_offs - offset;
+		return buf->start + offset;
+	}
+
+	*len = gbuf_len(buf) - offset;
+	return buf->start + offset + buf->gap_size;
+}
+
+void
+gbuf_spans(GBufSpanIter *it, GapBuf *buf, gbuf_offs offset, size_t len)
+{
+	size_t buf_len = gbuf_len(buf);
+	if (offset + len > buf_len)
+		len = offset < buf_len ? buf_len - offset : 0;
+
+	it->buf = buf;
+	it->offs = offset;
+	it->stop = offset + len;
+}
+
+bool
+gbuf_span_next(GBufSpanIter *it, GBufSpan *span)
+{
+	if (it->offs >= it->stop)
+		return false;
+
+	size_t run;
+	span->text = gbuf_get_run(it->buf, it->offs, &run);
+	span->len = run < (size_t)(it->stop - it->offs) ? run : (size_t)(it->stop - it->offs);
+	it->offs += span->len;
+
+	return span->len > 0;
+}
+
+/*
+ * Like gbuf_get_run(), but for the text before `offset'. Only for piece
+ * table, chunk and multi-gap storage.
+ */
+static const char *
+get_run_before(GapBuf *buf, gbuf_offs offset, size_t *len)
+{
+	if (buf->pt)
+		return ptab_get_before(buf->pt, offset, len);
+	if (buf->mg)
+		return mgap_get_before(buf->mg, offset, len);
+
+	return ctree_get_before(buf->ct, offset, len);
+}
+
+/*
+ * gbuf_grapheme_next() for piece table, chunk and multi-gap storage.
+ * Graphemes spanning two runs of text are copied to `buf->graph'.
+ */
+static int
+grapheme_next_runs(GapBuf *buf, const char **str, size_t *size, gbuf_offs *offset)
+{
+	size_t run;
+	const char *ptr = gbuf_get_run(buf, *offset, &run);
+	const char *nxt = grapheme_next_fast(ptr, ptr + run);
+	if (!nxt)
+		return -1;
+
+	size_t rest = gbuf_len(buf) - *offset;
+	if (nxt == ptr + run && run < rest) {
+		size_t n = rest < sizeof(buf->graph) ? rest : sizeof(buf->graph);
+		gbuf_strcpy(buf, buf->graph, *offset, n);
+		ptr = buf->graph;
+		nxt = grapheme_next_fast(ptr, ptr + n);
+	}
+
+	if (str)
+		*str = ptr;
+	if (size)
+		*size = nxt - ptr;
+
+	*offset += nxt - ptr;
+	return 0;
+}
+
+/*
+ * See grapheme_next_runs()
+ */
+static int
+grapheme_prev_runs(GapBuf *buf, const char **str, size_t *size, gbuf_offs *offset)
+{
+	size_t run;
+	const char *ptr = get_run_before(buf, *offset, &run);
+	const char *prev = grapheme_prev_fast(ptr, ptr - run);
+	if (!prev)
+		return -1;
+
+	if (prev == ptr - run && run < *offset) {
+		size_t n = *offset < sizeof(buf->graph) ? *offset : sizeof(buf->graph);
+		gbuf_strcpy(buf, buf->graph, *offset - n, n);
+		ptr = buf->graph + n;
+		prev = grapheme_prev_fast(ptr, buf->graph);
+	}
+
+	if (str)
+		*str = prev;
+	if (size)
+		*size = ptr - prev;
+
+	*offset -= ptr - prev;
+	return 0;
+}
+
 int
 gbuf_grapheme_next(GapBuf *buf, const char **str, size_t *size, gbuf_offs *offset)
 {
+	if (buf->pt || buf->ct || buf->mg)
+		return grapheme_next_runs(buf, str, size, offset);
+
 	const char *gbuf_stop = buf->start + buf->size;
+	const char *gap_start = buf->start + buf->gap_offs;
 	const char *ptr = gbuf_get(buf, *offset);
-	const char *nxt = u8_grapheme_next(ptr, gbuf_stop);
+	const char *nxt;
+
+	if (ptr < gap_start) {
+		/* Don't let libunistring look into the gap. If the grapheme
+		 * reaches the gap, it might continue on the other side: in
+		 * that case, move the (few) bytes before it across. */
+		nxt = grapheme_next_fast(ptr, gap_start);
+		if (nxt == gap_start && gap_start + buf->gap_size != gbuf_stop) {
+			gbuf_move_cursor(buf, *offset);
+			ptr = gbuf_get(buf, *offset);
+			nxt = grapheme_next_fast(ptr, gbuf_stop);
+		}
+	} else {
+		nxt = grapheme_next_fast(ptr, gbuf_stop);
+	}
+
 	if (!nxt)
 		return -1;
 
@@ -295,12 +659,28 @@ gbuf_grapheme_next(GapBuf *buf, const char **str, size_t *size, gbuf_offs *offse
 int
 gbuf_grapheme_prev(GapBuf *buf, const char **str, size_t *size, gbuf_offs *offset)
 {
+	if (buf->pt || buf->ct || buf->mg)
+		return grapheme_prev_runs(buf, str, size, offset);
+
 	const char *gbuf_stop = buf->start;
+	const char *gap_stop = buf->start + buf->gap_offs + buf->gap_size;
 	const char *ptr = (*offset == buf->gap_offs)
 	                ? (buf->start + buf->gap_offs)
 	                : gbuf_get(buf, *offset);
+	const char *prev;
+
+	if (ptr > gap_stop) {
+		/* See gbuf_grapheme_next() */
+		prev = grapheme_prev_fast(ptr, gap_stop);
+		if (prev == gap_stop && buf->gap_offs != 0) {
+			gbuf_move_cursor(buf, *offset);
+			ptr = buf->start + buf->gap_offs;
+			prev = grapheme_prev_fast(ptr, gbuf_stop);
+		}
+	} else {
+		prev = grapheme_prev_fast(ptr, gbuf_stop);
+	}
 
-	const char *prev = u8_grapheme_prev(ptr, gbuf_stop);
 	if (!prev)
 		return -1;
 
@@ -316,14 +696,19 @@ gbuf_grapheme_prev(GapBuf *buf, const char **str, size_t *size, gbuf_offs *offse
 void
 gbuf_strcpy(GapBuf *buf, char *dest, gbuf_offs offset, size_t len)
 {
-	for (int i = 0; i < len; ++i)
-		dest[i] = *gbuf_get(buf, offset + i);
+	GBufSpanIter it;
+	GBufSpan span;
+	gbuf_spans(&it, buf, offset, len);
+	while (gbuf_span_next(&it, &span)) {
+		memcpy(dest, span.text, span.len);
+		dest += span.len;
+	}
 }
 
 void
 gbuf_move_cursor(GapBuf *buf, gbuf_offs pos)
 {
-	if (pos == buf->gap_offs)
+	if (buf->pt || buf->ct || buf->mg || pos == buf->gap_offs)
 		return;
 
 	if (pos < buf->gap_offs) {
@@ -361,6 +746,10 @@ gbuf_move_cursor(GapBuf *buf, gbuf_offs pos)
  * - pipes[0] -> stdin
  * - pipes[1] <- stdout
  * - pipes[2] <- stderr
+ *
+ * The command is started with posix_spawn(), which doesn't copy the
+ * editor's memory the way fork() does, so starting it takes as long
+ * however large the buffers are.
  */
 static pid_t
 opencmd(const char *cmd, const char *const envp[], int pipes[3])
@@ -377,51 +766,47 @@ opencmd(const char *cmd, const char *const envp[], int pipes[3])
 	if (pipe(err) < 0)
 		goto out_fderr;
 
-	/* copy these onto the heap because of the fork() call later */
-	char *cmd_copy = strdup(cmd);
-
-	size_t nmemb;
-	for (nmemb = 0; envp[nmemb]; ++nmemb)
-		;
-
-	char **envp_copy = calloc(nmemb + 1, sizeof(char *));
-	for (int i = 0; envp[i]; ++i)
-		envp_copy[i] = strdup(envp[i]);
-
-	pid_t pid = fork();
-	switch (pid) {
-	case -1:
+	posix_spawn_file_actions_t actions;
+	if (posix_spawn_file_actions_init(&actions))
 		goto out;
 
-	case 0:
-		close(in[1]);
-		close(out[0]);
-		close(err[0]);
-
-		dup2(in[0], 0);
-		dup2(out[1], 1);
-		dup2(err[1], 2);
+	if (posix_spawn_file_actions_adddup2(&actions, in[0], 0)
+	 || posix_spawn_file_actions_adddup2(&actions, out[1], 1)
+	 || posix_spawn_file_actions_adddup2(&actions, err[1], 2))
+		goto out_actions;
+
+	/* if the editor was started without stdin, stdout or stderr, the
+	 * pipes may have been given those, and then they are the command's
+	 * own streams by now */
+	int fds[] = { in[0], in[1], out[0], out[1], err[0], err[1] };
+	for (int i = 0; i < 6; ++i) {
+		if (fds[i] > 2 && posix_spawn_file_actions_addclose(&actions, fds[i]))
+			goto out_actions;
+	}
 
-		char bash[] = "/bin/bash";
-		char *args[] = { bash, "-c", cmd_copy, NULL };
-		execve(bash, args, envp_copy);
+	char bash[] = "/bin/bash";
+	char c[] = "-c";
+	char *args[] = { bash, c, (char *)cmd, NULL };
 
-		/* an error has occured */
-		exit(1);
+	pid_t pid;
+	int spawn_err = posix_spawn(&pid, bash, &actions, NULL, args, (char *const *)envp);
+	posix_spawn_file_actions_destroy(&actions);
+	if (spawn_err)
+		goto out;
 
-	default:
-		close(in[0]);
-		close(out[1]);
-		close(err[1]);
+	close(in[0]);
+	close(out[1]);
+	close(err[1]);
 
-		pipes[0] = in[1];
-		pipes[1] = out[0];
-		pipes[2] = err[0];
-		break;
-	}
+	pipes[0] = in[1];
+	pipes[1] = out[0];
+	pipes[2] = err[0];
 
 	return pid;
 
+out_actions:
+	posix_spawn_file_actions_destroy(&actions);
+
 out:
 	close(err[0]);
 	close(err[1]);
@@ -438,6 +823,133 @@ out_fdin:
 	return -1;
 }
 
+/*
+ * State of a command that text is piped through. The selection goes to
+ * the command's stdin, while its stdout is streamed into the buffer and
+ * its stderr is passed on to ours, all at once, so that none of the
+ * pipes can fill up while the command waits for another one.
+ */
+struct pipe_job {
+	GapBuf *buf;
+	/* -1 once closed */
+	int fds[3];
+
+	/* text yet to be written to stdin starts at `in_offs' */
+	gbuf_offs in_offs;
+	size_t in_left;
+
+	/* where the output of the piece table, chunk and multi-gap storages
+	 * goes, after the text it replaces */
+	gbuf_offs out_offs;
+};
+
+static void
+pipe_close(struct pipe_job *job, int i)
+{
+	close(job->fds[i]);
+	job->fds[i] = -1;
+}
+
+/*
+ * Write as much of the text as the pipe takes. Returns -1 on error.
+ */
+static int
+pipe_feed(struct pipe_job *job)
+{
+	while (job->in_left) {
+		size_t run;
+		const char *text = gbuf_get_run(job->buf, job->in_offs, &run);
+		if (run > job->in_left)
+			run = job->in_left;
+
+		ssize_t n = write(job->fds[0], text, run);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && errno == EAGAIN)
+			return 0;
+		if (n < 0 && errno == EPIPE)
+			break; /* the command doesn't want the rest */
+		if (n < 0)
+			return -1;
+
+		job->in_offs += n;
+		job->in_left -= n;
+	}
+
+	pipe_close(job, 0);
+	return 0;
+}
+
+/*
+ * Read what output is available. For a plain gap buffer it is read into
+ * the gap, which lies right before the text being piped. Returns -1 on
+ * error.
+ */
+static int
+pipe_drain(struct pipe_job *job)
+{
+	GapBuf *buf = job->buf;
+	bool runs = buf->pt || buf->ct || buf->mg;
+
+	for (;;) {
+		char output[65536];
+		char *dest = output;
+		size_t room = sizeof(output);
+		if (!runs) {
+			if (!buf->gap_size && gbuf_resize(buf, buf->size + 512))
+				return -1;
+
+			dest = buf->start + buf->gap_offs;
+			room = buf->gap_size;
+		}
+
+		ssize_t n = read(job->fds[1], dest, room);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && errno == EAGAIN)
+			return 0;
+		if (n < 0)
+			return -1;
+
+		if (!n) {
+			pipe_close(job, 1);
+			return 0;
+		}
+
+		if (runs) {
+			gbuf_insert_text(buf, job->out_offs, output, n);
+			job->out_offs += n;
+		} else {
+			buf->gap_offs += n;
+			buf->gap_size -= n;
+			job->in_offs += n;
+		}
+	}
+}
+
+/*
+ * Pass what the command wrote to stderr on to our own.
+ */
+static void
+pipe_pass_errors(struct pipe_job *job)
+{
+	char errors[4096];
+	for (;;) {
+		ssize_t n = read(job->fds[2], errors, sizeof(errors));
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && errno == EAGAIN)
+			return;
+
+		if (n <= 0) {
+			pipe_close(job, 2);
+			return;
+		}
+
+		fwrite(errors, 1, n, stderr);
+	}
+}
+
 /*
  * Just a convenience function.
  */
@@ -457,66 +969,78 @@ gbuf_pipe_e(GapBuf *buf,
             gbuf_offs start_offs,
             size_t len)
 {
-	int ecode = 0;
-
-	int pipes[3];
-	if (opencmd(cmd, envp, pipes) < 0)
+	struct pipe_job job = {
+		.buf = buf,
+		.in_offs = start_offs,
+		.in_left = len,
+		.out_offs = start_offs + len
+	};
+
+	pid_t pid = opencmd(cmd, envp, job.fds);
+	if (pid < 0)
 		return -1;
 
-	char *start = offs_to_ptr(buf, start_offs);
-	char *stop = offs_to_ptr(buf, start_offs + len);
+	for (int i = 0; i < 3; ++i)
+		fcntl(job.fds[i], F_SETFL, fcntl(job.fds[i], F_GETFL) | O_NONBLOCK);
 
-	char *gap_start = buf->start + buf->gap_offs;
-	char *gap_stop = gap_start + buf->gap_size;
+	/* the output goes in front of the text, so that the text stays
+	 * where stdin is fed from */
+	bool runs = buf->pt || buf->ct || buf->mg;
+	if (!runs)
+		gbuf_move_cursor(buf, start_offs);
 
-	if (start <= gap_start && stop >= gap_stop) {
-		if (write(pipes[0], start, gap_start - start) < 0) {
-			ecode = -1;
-			close(pipes[0]);
-			goto stop;
-		}
+	/* a command that exits without reading all of stdin must not take
+	 * the editor with it */
+	void (*old_sigpipe)(int) = signal(SIGPIPE, SIG_IGN);
 
-		if (write(pipes[0], gap_stop, stop - gap_stop) < 0) {
-			ecode = -1;
-			close(pipes[0]);
-			goto stop;
+	int ecode = 0;
+	while (!ecode && (job.fds[1] >= 0 || job.fds[2] >= 0)) {
+		struct pollfd pfds[3];
+		for (int i = 0; i < 3; ++i) {
+			pfds[i].fd = job.fds[i];
+			pfds[i].events = i ? POLLIN : POLLOUT;
 		}
 
-		buf->gap_offs = start_offs;
-		buf->gap_size = stop - start;
-	} else {
-		if (write(pipes[0], start, stop - start) < 0) {
-			ecode = -1;
-			close(pipes[0]);
-			goto stop;
+		if (poll(pfds, 3, -1) < 0) {
+			if (errno != EINTR)
+				ecode = -1;
+			continue;
 		}
 
-		gbuf_move_cursor(buf, start_offs);
-		buf->gap_size += len;
+		if (pfds[0].revents && pipe_feed(&job))
+			ecode = -1;
+		if (pfds[1].revents && pipe_drain(&job))
+			ecode = -1;
+		if (pfds[2].revents)
+			pipe_pass_errors(&job);
 	}
 
-	close(pipes[0]);
+	signal(SIGPIPE, old_sigpipe);
 
-	if (!buf->gap_size)
-		gbuf_resize(buf, buf->size + 512);
+	for (int i = 0; i < 3; ++i) {
+		if (job.fds[i] >= 0)
+			close(job.fds[i]);
+	}
 
-	ssize_t write_size;
-	while (write_size = read(pipes[1], (buf->start + buf->gap_offs), buf->gap_size)) {
-		if (write_size < 0) {
-			ecode = -1;
-			goto stop;
+	waitpid(pid, NULL, 0);
+
+	if (ecode) {
+		/* a failed command leaves the text as it was, dropping what
+		 * output was read */
+		if (runs) {
+			gbuf_delete_text(buf, start_offs + len,
+			                 job.out_offs - start_offs - len);
+		} else {
+			buf->gap_size += buf->gap_offs - start_offs;
+			buf->gap_offs = start_offs;
 		}
-		buf->gap_offs += write_size;
-		buf->gap_size -= write_size;
-		if (buf->gap_size == 0)
-			gbuf_resize(buf, buf->size + 512);
+	} else if (runs) {
+		/* whatever was read replaces the text */
+		gbuf_delete_text(buf, start_offs, len);
+	} else {
+		buf->gap_size += len;
 	}
-
 	gbuf_auto_resize(buf);
 
-stop:
-	close(pipes[1]);
-	close(pipes[2]);
-
 	return ecode;
 }
@@ -0,0 +1,353 @@
+#include <werk/journal.h>
+#include <werk/varint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * The journal is a header followed by groups. A group is its payload
+ * length and the checksum of its payload, both 32-bit, then the payload:
+ * the changes, oldest first. Each change is a varint with its length
+ * shifted left once, the low bit set if it is an insertion, then a
+ * varint with its offset, then the inserted text, if any. Numbers are in
+ * host byte order, since a journal is only read back on the machine that
+ * wrote it.
+ */
+static const char magic[8] = "werkjnl1";
+
+struct header {
+	char magic[8];
+	/* of the file the changes apply to */
+	FileStamp file;
+};
+
+#define GROUP_HEAD (2 * sizeof(uint32_t))
+
+/*
+ * Header describing `filename' as it is now.
+ */
+static struct header header_of(const char *filename);
+
+/*
+ * Replace the contents of the journal by a header for `filename'.
+ */
+static int start_over(Journal *j, const char *filename);
+
+/*
+ * Redo the valid groups of `data', which holds the `len' bytes after the
+ * header. Returns the number of bytes they take up.
+ */
+static size_t replay(const char *data, size_t len,
+                     text_adder adder, text_deleter deleter,
+                     void (*end_group)(void *udata), void *udata);
+
+/*
+ * Write all `len' bytes of `data', or give up on the journal.
+ */
+static void write_all(Journal *j, const char *data, size_t len);
+
+/*
+ * Room for `len' more bytes in the group.
+ */
+static char *group_reserve(Journal *j, size_t len);
+
+static uint32_t checksum(const char *data, size_t len);
+
+/*
+ * Add a varint to the group.
+ */
+static void group_put(Journal *j, unsigned long val);
+
+void
+journal_init(Journal *j)
+{
+	memset(j, 0, sizeof(*j));
+	j->fd = -1;
+}
+
+int
+journal_open(Journal *j, const char *filename,
+             text_adder adder, text_deleter deleter,
+             void (*end_group)(void *udata), void *udata)
+{
+	j->path = sidecar_path(filename, ".werk-journal");
+	j->fd = open(j->path, O_RDWR | O_CREAT | O_APPEND, 0600);
+	if (j->fd < 0) {
+		free(j->path);
+		j->path = NULL;
+		return -1;
+	}
+
+	struct stat st;
+	char *data = NULL;
+	ssize_t got = 0;
+	if (!fstat(j->fd, &st) && st.st_size > (off_t)sizeof(struct header)) {
+		data = malloc(st.st_size);
+		got = pread(j->fd, data, st.st_size, 0);
+	}
+
+	struct header now = header_of(filename);
+	if (got < (ssize_t)sizeof(struct header) || memcmp(data, &now, sizeof(now))) {
+		if (got > 0)
+			fprintf(stderr, "warning: %s doesn't match the file, ignoring it.\n", j->path);
+
+		free(data);
+		return start_over(j, filename);
+	}
+
+	/* the fd must not write anything until the changes are made again,
+	 * or they would be journaled twice */
+	int fd = j->fd;
+	j->fd = -1;
+	size_t used = replay(data + sizeof(now), got - sizeof(now),
+	                     adder, deleter, end_group, udata);
+	j->fd = fd;
+	free(data);
+
+	/* drop a group torn by a crash */
+	if (ftruncate(j->fd, sizeof(now) + used)) {
+		journal_close(j);
+		return -1;
+	}
+
+	return 0;
+}
+
+void
+journal_close(Journal *j)
+{
+	if (j->fd >= 0) {
+		close(j->fd);
+		unlink(j->path);
+	}
+
+	free(j->path);
+	free(j->group);
+	journal_init(j);
+}
+
+char *
+journal_add(Journal *j, long offset, size_t len)
+{
+	if (j->fd < 0)
+		return NULL;
+
+	group_put(j, (unsigned long)len << 1 | 1);
+	group_put(j, offset);
+
+	char *text = group_reserve(j, len);
+	j->group_len += len;
+	return text;
+}
+
+void
+journal_delete(Journal *j, long offset, size_t len)
+{
+	if (j->fd < 0)
+		return;
+
+	group_put(j, (unsigned long)len << 1);
+	group_put(j, offset);
+}
+
+void
+journal_commit(Journal *j)
+{
+	if (j->fd < 0 || !j->group_len)
+		return;
+
+	/* the group goes out in one write(), behind its length and
+	 * checksum, which journal_add() and journal_delete() left room for
+	 * at the start */
+	uint32_t head[2] = { j->group_len - GROUP_HEAD, checksum(j->group + GROUP_HEAD, j->group_len - GROUP_HEAD) };
+	memcpy(j->group, head, GROUP_HEAD);
+	write_all(j, j->group, j->group_len);
+
+	j->group_len = 0;
+	j->unsynced = true;
+}
+
+void
+journal_sync(Journal *j)
+{
+	if (j->fd < 0 || !j->unsynced)
+		return;
+
+	fdatasync(j->fd);
+	j->unsynced = false;
+}
+
+void
+journal_reset(Journal *j, const char *filename)
+{
+	if (j->fd < 0)
+		return;
+
+	/* the group's changes were saved along with the rest */
+	j->group_len = 0;
+	start_over(j, filename);
+}
+
+char *
+sidecar_path(const char *filename, const char *suffix)
+{
+	const char *base = strrchr(filename, '/');
+	base = base ? base + 1 : filename;
+	size_t dir_len = base - filename;
+	size_t base_len = strlen(base);
+	size_t suffix_size = strlen(suffix) + 1;
+
+	char *path = malloc(dir_len + 1 + base_len + suffix_size);
+	memcpy(path, filename, dir_len);
+	path[dir_len] = '.';
+	memcpy(path + dir_len + 1, base, base_len);
+	memcpy(path + dir_len + 1 + base_len, suffix, suffix_size);
+	return path;
+}
+
+static struct header
+header_of(const char *filename)
+{
+	struct header h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, magic, sizeof(magic));
+	h.file = file_stamp(filename);
+	return h;
+}
+
+FileStamp
+file_stamp(const char *filename)
+{
+	FileStamp fs;
+	memset(&fs, 0, sizeof(fs));
+
+	struct stat st;
+	if (stat(filename, &st)) {
+		fs.size = -1;
+		return fs;
+	}
+
+	fs.size = st.st_size;
+	fs.mtime = st.st_mtim.tv_sec;
+	fs.mtime_nsec = st.st_mtim.tv_nsec;
+	fs.ctime = st.st_ctim.tv_sec;
+	fs.ctime_nsec = st.st_ctim.tv_nsec;
+	fs.ino = st.st_ino;
+	return fs;
+}
+
+static int
+start_over(Journal *j, const char *filename)
+{
+	struct header h = header_of(filename);
+	if (ftruncate(j->fd, 0)) {
+		journal_close(j);
+		return -1;
+	}
+
+	write_all(j, (const char *)&h, sizeof(h));
+	j->unsynced = true;
+	return j->fd < 0 ? -1 : 0;
+}
+
+static size_t
+replay(const char *data, size_t len,
+       text_adder adder, text_deleter deleter,
+       void (*end_group)(void *udata), void *udata)
+{
+	size_t used = 0;
+	while (len - used >= GROUP_HEAD) {
+		uint32_t head[2];
+		memcpy(head, data + used, GROUP_HEAD);
+
+		const unsigned char *p = (const unsigned char *)data + used + GROUP_HEAD;
+		const unsigned char *end = p + head[0];
+		if (head[0] > len - used - GROUP_HEAD || checksum((const char *)p, head[0]) != head[1])
+			break;
+
+		while (p < end) {
+			unsigned long tag, offset;
+			p = varint_get(p, end, &tag);
+			if (p)
+				p = varint_get(p, end, &offset);
+			if (!p)
+				break;
+
+			size_t change_len = tag >> 1;
+			if (!(tag & 1)) {
+				deleter(offset, change_len, NULL, udata);
+				continue;
+			}
+
+			if (change_len > (size_t)(end - p))
+				break;
+
+			adder(offset, (const char *)p, change_len, udata);
+			p += change_len;
+		}
+
+		end_group(udata);
+		used = (const char *)end - data;
+	}
+
+	return used;
+}
+
+static void
+write_all(Journal *j, const char *data, size_t len)
+{
+	while (len) {
+		ssize_t n = write(j->fd, data, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+
+		if (n <= 0) {
+			fprintf(stderr, "error writing journal: %s.\n", strerror(errno));
+			close(j->fd);
+			j->fd = -1;
+			return;
+		}
+
+		data += n;
+		len -= n;
+	}
+}
+
+static char *
+group_reserve(Journal *j, size_t len)
+{
+	if (!j->group_len)
+		j->group_len = GROUP_HEAD;
+
+	if (j->group_len + len > j->group_size) {
+		j->group_size = (j->group_len + len) * 2;
+		j->group = realloc(j->group, j->group_size);
+	}
+
+	return j->group + j->group_len;
+}
+
+static uint32_t
+checksum(const char *data, size_t len)
+{
+	/* FNV-1a */
+	uint32_t h = 2166136261u;
+	for (size_t i = 0; i < len; ++i) {
+		h ^= (unsigned char)data[i];
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+static void
+group_put(Journal *j, unsigned long val)
+{
+	unsigned char *p = (unsigned char *)group_reserve(j, varint_len(val));
+	j->group_len = (char *)varint_put(p, val, 0) - j->group;
+}
@@ -0,0 +1,722 @@
+#include <werk/lines.h>
+#include <werk/scan.h>
+#include <werk/treap.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistr.h>
+
+/*
+ * Text is validated and scanned for newlines in blocks of this size when
+ * loading, so that each block is read from memory only once.
+ */
+#define LOAD_BLOCK (64 * 1024)
+
+/*
+ * Number of unused nodes kept around by a line index, so that typing
+ * newlines doesn't need to go through malloc() and free().
+ */
+#define LIDX_POOL 16
+
+/*
+ * Newline sequences counted by lidx_rebuild(). On a tie, the one listed
+ * first wins.
+ */
+static const char *const newlines[] = {
+	u8"\n", u8"\r\n", u8"\r", u8"\f", u8"\v",
+	u8"\xc2\x85", u8"\u2028", u8"\u2029",
+};
+
+#define NEWLINE_KINDS (sizeof(newlines) / sizeof(newlines[0]))
+
+/*
+ * Growable array of line lengths, with some room on the stack so that
+ * ordinary keystrokes don't need to allocate.
+ */
+struct len_vec {
+	gbuf_offs *v;
+	size_t n, cap;
+	gbuf_offs small[32];
+};
+
+static void
+len_vec_init(struct len_vec *vec)
+{
+	vec->v = vec->small;
+	vec->n = 0;
+	vec->cap = sizeof(vec->small) / sizeof(vec->small[0]);
+}
+
+static void
+len_vec_push(struct len_vec *vec, gbuf_offs len)
+{
+	if (vec->n == vec->cap) {
+		size_t new_cap = vec->cap * 2;
+		gbuf_offs *new_v = malloc(new_cap * sizeof(gbuf_offs));
+		memcpy(new_v, vec->v, vec->n * sizeof(gbuf_offs));
+		if (vec->v != vec->small)
+			free(vec->v);
+		vec->v = new_v;
+		vec->cap = new_cap;
+	}
+
+	vec->v[vec->n++] = len;
+}
+
+static void
+len_vec_destroy(struct len_vec *vec)
+{
+	if (vec->v != vec->small)
+		free(vec->v);
+}
+
+/*                 _
+ *  _ __   ___   __| | ___  ___
+ * | '_ \ / _ \ / _` |/ _ \/ __|
+ * | | | | (_) | (_| |  __/\__ \
+ * |_| |_|\___/ \__,_|\___||___/
+ */
+
+static int
+sub_lines(struct lidx_node *node)
+{
+	return node ? node->sub_lines : 0;
+}
+
+static long
+sub_bytes(struct lidx_node *node)
+{
+	return node ? node->sub_bytes : 0;
+}
+
+static struct lidx_node *
+node_update(struct lidx_node *node)
+{
+	node->sub_lines = sub_lines(node->link[0]) + node->n + sub_lines(node->link[1]);
+	node->sub_bytes = sub_bytes(node->link[0]) + node->bytes + sub_bytes(node->link[1]);
+	return node;
+}
+
+static struct lidx_node *
+node_create(LineIndex *idx, const gbuf_offs *lens, int n)
+{
+	struct lidx_node *node = idx->pool;
+	if (node) {
+		idx->pool = node->link[0];
+		--idx->pool_size;
+	} else {
+		node = malloc(sizeof(struct lidx_node));
+	}
+
+	node->link[0] = node->link[1] = NULL;
+	node->prio = next_prio();
+	node->n = n;
+	node->bytes = 0;
+	for (int i = 0; i < n; ++i) {
+		node->len[i] = lens[i];
+		node->bytes += lens[i];
+	}
+
+	return node_update(node);
+}
+
+/*
+ * Return `node' to the pool of `idx', or free it if the pool is full.
+ */
+static void
+node_free(LineIndex *idx, struct lidx_node *node)
+{
+	if (idx->pool_size == LIDX_POOL) {
+		free(node);
+		return;
+	}
+
+	node->link[0] = idx->pool;
+	idx->pool = node;
+	++idx->pool_size;
+}
+
+static void
+tree_free(LineIndex *idx, struct lidx_node *node)
+{
+	if (!node)
+		return;
+
+	tree_free(idx, node->link[0]);
+	tree_free(idx, node->link[1]);
+	node_free(idx, node);
+}
+
+static struct lidx_node *
+merge(struct lidx_node *a, struct lidx_node *b)
+{
+	if (!a)
+		return b;
+	if (!b)
+		return a;
+
+	if (a->prio > b->prio) {
+		a->link[1] = merge(a->link[1], b);
+		return node_update(a);
+	}
+
+	b->link[0] = merge(a, b->link[0]);
+	return node_update(b);
+}
+
+/*
+ * Split `node' so that `*a' contains the first `k' lines, and `*b' the
+ * remaining ones. A node is split in two if needed.
+ */
+static void
+split(LineIndex *idx, struct lidx_node *node, int k, struct lidx_node **a, struct lidx_node **b)
+{
+	if (!node) {
+		*a = *b = NULL;
+		return;
+	}
+
+	int left = sub_lines(node->link[0]);
+
+	if (k <= left) {
+		split(idx, node->link[0], k, a, &node->link[0]);
+		*b = node_update(node);
+		return;
+	}
+
+	if (k >= left + node->n) {
+		split(idx, node->link[1], k - left - node->n, &node->link[1], b);
+		*a = node_update(node);
+		return;
+	}
+
+	int keep = k - left;
+	struct lidx_node *rest = node_create(idx, node->len + keep, node->n - keep);
+	*b = merge(rest, node->link[1]);
+
+	node->link[1] = NULL;
+	node->n = keep;
+	node->bytes -= rest->bytes;
+	*a = node_update(node);
+}
+
+/*
+ * Detach rightmost (dir = 1) or leftmost (dir = 0) node from the tree.
+ */
+static struct lidx_node *
+take_outer(struct lidx_node *node, int dir, struct lidx_node **taken)
+{
+	if (!node->link[dir]) {
+		struct lidx_node *other = node->link[!dir];
+		node->link[!dir] = NULL;
+		*taken = node_update(node);
+		return other;
+	}
+
+	node->link[dir] = take_outer(node->link[dir], dir, taken);
+	return node_update(node);
+}
+
+static struct lidx_node *
+build(LineIndex *idx, const gbuf_offs *lens, size_t n)
+{
+	struct lidx_node *res = NULL;
+	for (size_t i = 0; i < n; i += LIDX_BLOCK) {
+		size_t chunk = n - i < LIDX_BLOCK ? n - i : LIDX_BLOCK;
+		res = merge(res, node_create(idx, lens + i, chunk));
+	}
+
+	return res;
+}
+
+/*
+ * Find node containing (0-based) line `*line', and make `*line' relative
+ * to that node. `*start' receives the offset of the node's first line.
+ */
+static struct lidx_node *
+find_line(struct lidx_node *node, int *line, long *start)
+{
+	*start = 0;
+
+	while (node) {
+		int left = sub_lines(node->link[0]);
+		if (*line < left) {
+			node = node->link[0];
+			continue;
+		}
+
+		*line -= left;
+		*start += sub_bytes(node->link[0]);
+		if (*line < node->n)
+			return node;
+
+		*line -= node->n;
+		*start += node->bytes;
+		node = node->link[1];
+	}
+
+	return NULL;
+}
+
+static gbuf_offs
+line_len(LineIndex *idx, int line)
+{
+	long start;
+	struct lidx_node *node = find_line(idx->root, &line, &start);
+	return node->len[line];
+}
+
+/*
+ * Change length of a single (0-based) line.
+ */
+static void
+set_line_len(LineIndex *idx, int line, gbuf_offs len)
+{
+	long delta = len - line_len(idx, line);
+
+	struct lidx_node *node = idx->root;
+	for (;;) {
+		node->sub_bytes += delta;
+
+		int left = sub_lines(node->link[0]);
+		if (line < left) {
+			node = node->link[0];
+			continue;
+		}
+
+		line -= left;
+		if (line < node->n) {
+			node->len[line] = len;
+			node->bytes += delta;
+			return;
+		}
+
+		line -= node->n;
+		node = node->link[1];
+	}
+}
+
+/*
+ * Replace (0-based) lines `first' until `last' (inclusive) with `n' new
+ * lines.
+ */
+static void
+replace_lines(LineIndex *idx, int first, int last, const gbuf_offs *lens, size_t n)
+{
+	if (first == last && n == 1) {
+		set_line_len(idx, first, lens[0]);
+		return;
+	}
+
+	struct lidx_node *a, *m, *c, *rest;
+	split(idx, idx->root, first, &a, &rest);
+	split(idx, rest, last - first + 1, &m, &c);
+
+	/* Rebuild the neighbouring nodes as well, so that edits don't
+	 * leave lots of tiny nodes behind */
+	struct lidx_node *before = NULL, *after = NULL;
+	if (a)
+		a = take_outer(a, 1, &before);
+	if (c)
+		c = take_outer(c, 0, &after);
+
+	struct len_vec all;
+	len_vec_init(&all);
+	for (int i = 0; before && i < before->n; ++i)
+		len_vec_push(&all, before->len[i]);
+	for (size_t i = 0; i < n; ++i)
+		len_vec_push(&all, lens[i]);
+	for (int i = 0; after && i < after->n; ++i)
+		len_vec_push(&all, after->len[i]);
+
+	tree_free(idx, m);
+	if (before)
+		node_free(idx, before);
+	if (after)
+		node_free(idx, after);
+
+	idx->root = merge(merge(a, build(idx, all.v, all.n)), c);
+
+	len_vec_destroy(&all);
+}
+
+/*  _           _
+ * (_)_ __   __| | _____  __
+ * | | '_ \ / _` |/ _ \ \/ /
+ * | | | | | (_| |  __/>  <
+ * |_|_| |_|\__,_|\___/_/\_\
+ */
+
+void
+lidx_init(LineIndex *idx)
+{
+	gbuf_offs empty = 0;
+	idx->pool = NULL;
+	idx->pool_size = 0;
+	idx->root = node_create(idx, &empty, 1);
+}
+
+void
+lidx_destroy(LineIndex *idx)
+{
+	tree_free(idx, idx->root);
+	idx->root = NULL;
+
+	while (idx->pool) {
+		struct lidx_node *next = idx->pool->link[0];
+		free(idx->pool);
+		idx->pool = next;
+	}
+	idx->pool_size = 0;
+}
+
+static int
+byte_at(GapBuf *gbuf, gbuf_offs offs)
+{
+	if (offs < 0 || offs >= gbuf_len(gbuf))
+		return -1;
+
+	return (unsigned char)*gbuf_get(gbuf, offs);
+}
+
+size_t
+lidx_newline_size(GapBuf *gbuf, gbuf_offs offs)
+{
+	switch (byte_at(gbuf, offs)) {
+	case '\n':
+	case '\v':
+	case '\f':
+		return 1;
+	case '\r':
+		return byte_at(gbuf, offs + 1) == '\n' ? 2 : 1;
+	case 0xc2: /* U+0085 */
+		return byte_at(gbuf, offs + 1) == 0x85 ? 2 : 0;
+	case 0xe2: /* U+2028, U+2029 */
+		if (byte_at(gbuf, offs + 1) != 0x80)
+			return 0;
+		switch (byte_at(gbuf, offs + 2)) {
+		case 0xa8:
+		case 0xa9:
+			return 3;
+		}
+		return 0;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Index into newlines[] of the `nl' byte newline at `offs'.
+ */
+static int
+newline_kind(GapBuf *gbuf, gbuf_offs offs, size_t nl)
+{
+	switch (byte_at(gbuf, offs)) {
+	case '\n':
+		return 0;
+	case '\r':
+		return nl == 2 ? 1 : 2;
+	case '\f':
+		return 3;
+	case '\v':
+		return 4;
+	case 0xc2:
+		return 5;
+	default:
+		return byte_at(gbuf, offs + 2) == 0xa8 ? 6 : 7;
+	}
+}
+
+/*
+ * Append the offset directly following every newline which starts in
+ * [from, to) to `ends'. Returns where scanning stopped: `to', or past a
+ * newline that started before it. Newlines are also counted by kind in
+ * `eol_count', unless it's NULL.
+ */
+static gbuf_offs
+scan_newlines(GapBuf *gbuf, gbuf_offs from, gbuf_offs to, struct len_vec *ends, size_t *eol_count)
+{
+	gbuf_offs ofs = from;
+	while (ofs < to) {
+		/* stay within contiguous text */
+		size_t run_len;
+		const char *run = gbuf_get_run(gbuf, ofs, &run_len);
+		gbuf_offs run_stop = to;
+		if (run_len < (size_t)(to - ofs))
+			run_stop = ofs + run_len;
+
+		while (ofs < run_stop) {
+			size_t skip = scan_newline(run, run_stop - ofs);
+			ofs += skip;
+			run += skip;
+			if (ofs == run_stop)
+				break;
+
+			size_t nl = lidx_newline_size(gbuf, ofs);
+			if (nl == 0) {
+				nl = 1;
+			} else {
+				len_vec_push(ends, ofs + nl);
+				if (eol_count)
+					++eol_count[newline_kind(gbuf, ofs, nl)];
+			}
+
+			ofs += nl;
+			run += nl;
+		}
+	}
+
+	return ofs;
+}
+
+/*
+ * Check that `len' bytes at `s' are valid UTF-8. Stretches of ASCII are
+ * skipped quickly, and only the rest is left to libunistring. Clears
+ * `ascii' if there is anything else.
+ */
+static bool
+check_block(const char *s, size_t len, bool *ascii)
+{
+	size_t i = 0;
+	while (i < len) {
+		i += scan_ascii(s + i, len - i);
+		if (i == len)
+			break;
+
+		*ascii = false;
+
+		/* multibyte sequences consist of non-ASCII bytes only */
+		size_t j = i;
+		while (j < len && (s[j] & 0x80))
+			++j;
+
+		if (u8_check(s + i, j - i))
+			return false;
+
+		i = j;
+	}
+
+	return true;
+}
+
+/*
+ * Whether text from `offs' to the end is all printable ASCII.
+ */
+static bool
+plain_until_end(GapBuf *gbuf, gbuf_offs offs)
+{
+	GBufSpanIter it;
+	GBufSpan span;
+	gbuf_spans(&it, gbuf, offs, gbuf_len(gbuf) - offs);
+	while (gbuf_span_next(&it, &span))
+		if (scan_printable(span.text, span.len) != span.len)
+			return false;
+
+	return true;
+}
+
+int
+lidx_rebuild(LineIndex *idx, GapBuf *gbuf, LidxStats *stats)
+{
+	struct len_vec ends;
+	len_vec_init(&ends);
+
+	size_t eol_count[NEWLINE_KINDS] = { 0 };
+	bool ascii = true;
+
+	/* Each block is validated and then scanned for newlines while it
+	 * is still in cache */
+	gbuf_offs len = gbuf_len(gbuf);
+	gbuf_offs scanned = 0;
+	for (gbuf_offs ofs = 0; ofs < len; ) {
+		size_t run_len;
+		const char *run = gbuf_get_run(gbuf, ofs, &run_len);
+
+		/* don't end a block in the middle of a UTF-8 sequence */
+		size_t n = run_len < LOAD_BLOCK ? run_len : LOAD_BLOCK;
+		while (n < run_len && n < LOAD_BLOCK + 3 && (run[n] & 0xc0) == 0x80)
+			++n;
+
+		if (!check_block(run, n, &ascii)) {
+			len_vec_destroy(&ends);
+			return -1;
+		}
+
+		if (scanned < ofs + n)
+			scanned = scan_newlines(gbuf, scanned, ofs + n, &ends, eol_count);
+
+		ofs += n;
+	}
+
+	if (stats) {
+		stats->ascii = ascii;
+
+		stats->eol = NULL;
+		size_t most = 0;
+		for (size_t i = 0; i < NEWLINE_KINDS; ++i) {
+			if (eol_count[i] > most) {
+				most = eol_count[i];
+				stats->eol = newlines[i];
+			}
+		}
+
+		gbuf_offs last_start = ends.n ? ends.v[ends.n - 1] : 0;
+		stats->plain_last_line = plain_until_end(gbuf, last_start);
+	}
+
+	/* the last line has no newline */
+	len_vec_push(&ends, len);
+
+	gbuf_offs prev = 0;
+	for (size_t i = 0; i < ends.n; ++i) {
+		gbuf_offs end = ends.v[i];
+		ends.v[i] = end - prev;
+		prev = end;
+	}
+
+	lidx_destroy(idx);
+	idx->root = build(idx, ends.v, ends.n);
+
+	len_vec_destroy(&ends);
+	return 0;
+}
+
+void
+lidx_update(LineIndex *idx, GapBuf *gbuf, gbuf_offs offs, size_t removed, size_t added)
+{
+	/*
+	 * Lines `first' through `last' (0-based, inclusive) are replaced.
+	 * The index still describes the old text, but everything before
+	 * `offs' is the same in the old and the new text.
+	 */
+	gbuf_offs first_start;
+	int first = lidx_line_of(idx, offs, &first_start) - 1;
+
+	/* a lone CR directly before the edit may become part of a CR LF */
+	bool after_cr = offs > 0 && byte_at(gbuf, offs - 1) == '\r';
+	if (after_cr && first_start == offs && first > 0) {
+		--first;
+		first_start -= line_len(idx, first);
+	}
+
+	gbuf_offs last_start;
+	int last = lidx_line_of(idx, offs + removed, &last_start) - 1;
+	bool last_is_final = last == lidx_lines(idx) - 1;
+	gbuf_offs new_end = last_start + line_len(idx, last) - removed + added;
+
+	/*
+	 * Scan the inserted text, plus one byte on either side to catch
+	 * CR LF pairs being formed or broken up. The remainder of the last
+	 * line is known to contain only its own newline.
+	 */
+	gbuf_offs from = after_cr ? offs - 1 : offs;
+	gbuf_offs to = offs + added + 1;
+	if (to > new_end)
+		to = new_end;
+
+	struct len_vec ends;
+	len_vec_init(&ends);
+	scan_newlines(gbuf, from, to, &ends, NULL);
+
+	while (ends.n && ends.v[ends.n - 1] > new_end)
+		--ends.n;
+
+	if (!last_is_final && (ends.n == 0 || ends.v[ends.n - 1] != new_end))
+		len_vec_push(&ends, new_end);
+
+	if (last_is_final)
+		len_vec_push(&ends, new_end);
+
+	/* convert to lengths */
+	gbuf_offs prev = first_start;
+	for (size_t i = 0; i < ends.n; ++i) {
+		gbuf_offs end = ends.v[i];
+		ends.v[i] = end - prev;
+		prev = end;
+	}
+
+	replace_lines(idx, first, last, ends.v, ends.n);
+
+	len_vec_destroy(&ends);
+}
+
+gbuf_offs
+lidx_line_start(LineIndex *idx, int line)
+{
+	if (line < 1)
+		line = 1;
+	if (line > lidx_lines(idx))
+		line = lidx_lines(idx);
+
+	--line;
+
+	long start;
+	struct lidx_node *node = find_line(idx->root, &line, &start);
+	for (int i = 0; i < line; ++i)
+		start += node->len[i];
+
+	return start;
+}
+
+gbuf_offs
+lidx_line_end(LineIndex *idx, GapBuf *gbuf, int line)
+{
+	gbuf_offs start = lidx_line_start(idx, line);
+	if (line >= lidx_lines(idx))
+		return gbuf_len(gbuf);
+
+	gbuf_offs end = start + line_len(idx, line - 1);
+
+	/* find out where the newline starts (longest match first) */
+	gbuf_offs nl = end - 3;
+	if (nl < start)
+		nl = start;
+
+	for (; nl < end; ++nl)
+		if (lidx_newline_size(gbuf, nl) == end - nl)
+			return nl;
+
+	return end;
+}
+
+int
+lidx_line_of(LineIndex *idx, gbuf_offs offs, gbuf_offs *line_start)
+{
+	struct lidx_node *node = idx->root;
+	int line = 0;
+	long start = 0;
+
+	while (node) {
+		long left = sub_bytes(node->link[0]);
+		if (offs - start < left) {
+			node = node->link[0];
+			continue;
+		}
+
+		start += left;
+		line += sub_lines(node->link[0]);
+
+		if (offs - start < node->bytes) {
+			for (int i = 0; ; ++i) {
+				if (offs - start < node->len[i]) {
+					if (line_start)
+						*line_start = start;
+					return line + i + 1;
+				}
+
+				start += node->len[i];
+			}
+		}
+
+		start += node->bytes;
+		line += node->n;
+		node = node->link[1];
+	}
+
+	/* the very end of the buffer belongs to the last line */
+	line = lidx_lines(idx);
+	if (line_start)
+		*line_start = idx->root->sub_bytes - line_len(idx, line - 1);
+
+	return line;
+}
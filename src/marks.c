@@ -0,0 +1,357 @@
+#include <werk/marks.h>
+#include <werk/treap.h>
+#include <stddef.h>
+
+/*
+ * Pass the `collapsed' flag of `m' on to its children.
+ */
+static void
+push_down(Mark *m)
+{
+	if (!m->collapsed)
+		return;
+
+	for (int i = 0; i < 2; ++i) {
+		Mark *child = m->link[i];
+		if (child) {
+			child->offset = 0;
+			child->line = 0;
+			child->collapsed = true;
+		}
+	}
+
+	m->collapsed = false;
+}
+
+/*
+ * Rotate `m' above its parent, keeping all absolute positions the same.
+ */
+static void
+rotate_up(MarkTree *t, Mark *m)
+{
+	Mark *p = m->parent;
+	push_down(p);
+	push_down(m);
+
+	int dir = p->link[1] == m;
+	Mark *inner = m->link[!dir];
+
+	/* `m' becomes relative to the old grandparent, `p' relative to
+	 * `m', and `inner' relative to `p' */
+	long m_offset = m->offset;
+	int m_line = m->line;
+	m->offset += p->offset;
+	m->line += p->line;
+	p->offset = -m_offset;
+	p->line = -m_line;
+	if (inner) {
+		inner->offset += m_offset;
+		inner->line += m_line;
+	}
+
+	p->link[dir] = inner;
+	if (inner)
+		inner->parent = p;
+
+	m->parent = p->parent;
+	if (p->parent)
+		p->parent->link[p->parent->link[1] == p] = m;
+	else
+		t->root = m;
+
+	m->link[!dir] = p;
+	p->parent = m;
+}
+
+void
+mtree_init(MarkTree *t)
+{
+	t->root = NULL;
+}
+
+void
+mtree_insert(MarkTree *t, Mark *m, long offset, int line)
+{
+	m->link[0] = m->link[1] = NULL;
+	m->prio = next_prio();
+	m->collapsed = false;
+
+	Mark *parent = NULL;
+	long base = 0;
+	int line_base = 0;
+	int dir = 0;
+	for (Mark *cur = t->root; cur; cur = cur->link[dir]) {
+		push_down(cur);
+		base += cur->offset;
+		line_base += cur->line;
+		parent = cur;
+		dir = offset >= base;
+	}
+
+	m->parent = parent;
+	m->offset = offset - base;
+	m->line = line - line_base;
+	if (parent)
+		parent->link[dir] = m;
+	else
+		t->root = m;
+
+	while (m->parent && m->prio > m->parent->prio)
+		rotate_up(t, m);
+}
+
+void
+mtree_remove(MarkTree *t, Mark *m)
+{
+	/* rotate `m' down until it is a leaf */
+	while (m->link[0] || m->link[1]) {
+		Mark *child;
+		if (!m->link[0])
+			child = m->link[1];
+		else if (!m->link[1])
+			child = m->link[0];
+		else
+			child = m->link[m->link[1]->prio > m->link[0]->prio];
+
+		rotate_up(t, child);
+	}
+
+	if (m->parent)
+		m->parent->link[m->parent->link[1] == m] = NULL;
+	else
+		t->root = NULL;
+
+	m->parent = NULL;
+}
+
+/*
+ * Move all marks after `pivot' by `doffs' bytes and `dlines' lines.
+ */
+static void
+shift_after(MarkTree *t, long pivot, long doffs, int dlines)
+{
+	/* absolute offset of the parent of `m' */
+	long base = 0;
+
+	Mark *m = t->root;
+	while (m) {
+		push_down(m);
+
+		long offset = base + m->offset;
+		if (offset <= pivot) {
+			base = offset;
+			m = m->link[1];
+			continue;
+		}
+
+		/* moves `m' and both its subtrees; the left one is then
+		 * moved back, and handled the same way */
+		m->offset += doffs;
+		m->line += dlines;
+
+		Mark *left = m->link[0];
+		if (left) {
+			left->offset -= doffs;
+			left->line -= dlines;
+		}
+
+		base = offset + doffs;
+		m = left;
+	}
+}
+
+/*
+ * Make child `m' of a mark at `offset', on `line', the root of its own
+ * tree.
+ */
+static Mark *
+detach(Mark *m, long offset, int line)
+{
+	if (m) {
+		m->offset += offset;
+		m->line += line;
+		m->parent = NULL;
+	}
+
+	return m;
+}
+
+/*
+ * Make root `m' the `dir' child of `parent', which is itself a root.
+ */
+static void
+attach(Mark *parent, int dir, Mark *m)
+{
+	parent->link[dir] = m;
+	if (m) {
+		m->offset -= parent->offset;
+		m->line -= parent->line;
+		m->parent = parent;
+	}
+}
+
+/*
+ * Split tree `m' in the marks before `offset' and the ones after.
+ */
+static void
+split(Mark *m, long offset, Mark **before, Mark **after)
+{
+	if (!m) {
+		*before = *after = NULL;
+		return;
+	}
+
+	push_down(m);
+
+	Mark *inner;
+	if (m->offset < offset) {
+		split(detach(m->link[1], m->offset, m->line), offset, &inner, after);
+		attach(m, 1, inner);
+		*before = m;
+	} else {
+		split(detach(m->link[0], m->offset, m->line), offset, before, &inner);
+		attach(m, 0, inner);
+		*after = m;
+	}
+}
+
+/*
+ * Join trees `a' and `b', where all marks in `a' come before those in
+ * `b'.
+ */
+static Mark *
+join(Mark *a, Mark *b)
+{
+	if (!a)
+		return b;
+	if (!b)
+		return a;
+
+	if (a->prio > b->prio) {
+		push_down(a);
+		attach(a, 1, join(detach(a->link[1], a->offset, a->line), b));
+		return a;
+	}
+
+	push_down(b);
+	attach(b, 0, join(a, detach(b->link[0], b->offset, b->line)));
+	return b;
+}
+
+void
+mtree_edit(MarkTree *t, long offset, long removed, long added, int dlines, int line)
+{
+	Mark *m;
+
+	if (removed) {
+		Mark *before, *within, *after;
+		split(t->root, offset + 1, &before, &after);
+		split(after, offset + removed, &within, &after);
+
+		/* marks within the removed text move to its start */
+		if (within) {
+			within->offset = offset;
+			within->line = line;
+			within->collapsed = true;
+		}
+
+		if (after) {
+			after->offset += added - removed;
+			after->line += dlines;
+		}
+
+		t->root = join(join(before, within), after);
+		return;
+	}
+
+	/* marks right at an insertion that move along with it are taken
+	 * out meanwhile, linked through link[0] and with their absolute
+	 * line in `line' */
+	Mark *moving = NULL;
+	for (m = mtree_first_from(t, offset); m && mark_offset(m) == offset; ) {
+		Mark *next = mark_next(m);
+		if (m->right_gravity) {
+			int m_line = mark_line(m);
+			mtree_remove(t, m);
+			m->line = m_line;
+			m->link[0] = moving;
+			moving = m;
+		}
+
+		m = next;
+	}
+
+	shift_after(t, offset, added, dlines);
+
+	while (moving) {
+		m = moving;
+		moving = m->link[0];
+		mtree_insert(t, m, offset + added, m->line + dlines);
+	}
+}
+
+Mark *
+mtree_first_from(MarkTree *t, long offset)
+{
+	Mark *found = NULL;
+	long base = 0;
+
+	Mark *m = t->root;
+	while (m) {
+		push_down(m);
+		base += m->offset;
+		if (base >= offset) {
+			found = m;
+			m = m->link[0];
+		} else {
+			m = m->link[1];
+		}
+	}
+
+	return found;
+}
+
+Mark *
+mark_next(Mark *m)
+{
+	if (m->link[1]) {
+		m = m->link[1];
+		while (m->link[0])
+			m = m->link[0];
+
+		return m;
+	}
+
+	while (m->parent && m->parent->link[1] == m)
+		m = m->parent;
+
+	return m->parent;
+}
+
+long
+mark_offset(const Mark *m)
+{
+	long offset = 0;
+	for (; m; m = m->parent) {
+		if (m->parent && m->parent->collapsed)
+			offset = 0;
+		else
+			offset += m->offset;
+	}
+
+	return offset;
+}
+
+int
+mark_line(const Mark *m)
+{
+	int line = 0;
+	for (; m; m = m->parent) {
+		if (m->parent && m->parent->collapsed)
+			line = 0;
+		else
+			line += m->line;
+	}
+
+	return line;
+}
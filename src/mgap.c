@@ -0,0 +1,283 @@
+#include <werk/mgap.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Physical offset of the start of gap `i'.
+ */
+static size_t
+gap_start(MultiGap *mg, int i)
+{
+	size_t p = mg->gap[i].offs;
+	for (int j = 0; j < i; ++j)
+		p += mg->gap[j].size;
+
+	return p;
+}
+
+static void
+add_gap(MultiGap *mg, int i, size_t offs, size_t size)
+{
+	memmove(mg->gap + i + 1, mg->gap + i, (mg->ngaps - i) * sizeof(struct mgap));
+	mg->gap[i].offs = offs;
+	mg->gap[i].size = size;
+	++mg->ngaps;
+}
+
+static void
+remove_gap(MultiGap *mg, int i)
+{
+	--mg->ngaps;
+	memmove(mg->gap + i, mg->gap + i + 1, (mg->ngaps - i) * sizeof(struct mgap));
+}
+
+/*
+ * Index of the gap closest to `pos'. There must be at least one gap.
+ */
+static int
+nearest_gap(MultiGap *mg, size_t pos)
+{
+	int i;
+	for (i = 0; i < mg->ngaps && mg->gap[i].offs < pos; ++i)
+		;
+
+	if (i == mg->ngaps)
+		return i - 1;
+	if (i == 0)
+		return 0;
+
+	/* gaps on either side */
+	return pos - mg->gap[i - 1].offs < mg->gap[i].offs - pos ? i - 1 : i;
+}
+
+/*
+ * Move gap `i' to `pos'. No other gap may lie in between.
+ */
+static void
+move_gap(MultiGap *mg, int i, size_t pos)
+{
+	struct mgap *g = &mg->gap[i];
+	char *start = mg->text + gap_start(mg, i);
+
+	if (pos < g->offs)
+		memmove(start + g->size - (g->offs - pos), start - (g->offs - pos), g->offs - pos);
+	else
+		memmove(start, start + g->size, pos - g->offs);
+
+	g->offs = pos;
+}
+
+/*
+ * Open a new gap at `pos', with half the room of gap `i'. No other gap
+ * may lie in between. Returns the index of the new gap.
+ */
+static int
+split_gap(MultiGap *mg, int i, size_t pos)
+{
+	struct mgap *g = &mg->gap[i];
+	char *start = mg->text + gap_start(mg, i);
+	size_t half = g->size / 2;
+
+	g->size -= half;
+	if (pos > g->offs) {
+		/* the text in between moves down into the lower half */
+		memmove(start + g->size, start + g->size + half, pos - g->offs);
+		add_gap(mg, i + 1, pos, half);
+		return i + 1;
+	}
+
+	/* the text in between moves up into the upper half */
+	memmove(start - (g->offs - pos) + half, start - (g->offs - pos), g->offs - pos);
+	add_gap(mg, i, pos, half);
+	return i;
+}
+
+/*
+ * Index of a gap at `pos', moving or opening one as needed. If the
+ * buffer has no gaps left, an empty one is returned.
+ */
+static int
+gap_at(MultiGap *mg, size_t pos)
+{
+	if (!mg->ngaps) {
+		add_gap(mg, 0, pos, 0);
+		return 0;
+	}
+
+	int i = nearest_gap(mg, pos);
+	size_t offs = mg->gap[i].offs;
+	size_t dist = offs < pos ? pos - offs : offs - pos;
+	if (dist == 0)
+		return i;
+
+	if (dist <= MGAP_NEAR || mg->ngaps == MGAP_MAX || mg->gap[i].size < 2) {
+		move_gap(mg, i, pos);
+		return i;
+	}
+
+	return split_gap(mg, i, pos);
+}
+
+/*
+ * Add `extra' bytes of room to gap `i'.
+ */
+static void
+grow_gap(MultiGap *mg, int i, size_t extra)
+{
+	size_t end = gap_start(mg, i) + mg->gap[i].size;
+
+	mg->text = realloc(mg->text, mg->size + extra);
+	memmove(mg->text + end + extra, mg->text + end, mg->size - end);
+	mg->size += extra;
+	mg->gap[i].size += extra;
+}
+
+/*
+ * Close all gaps and give the buffer a single gap of MGAP_GROW bytes at
+ * `pos'.
+ */
+static void
+compact(MultiGap *mg, size_t pos)
+{
+	size_t logical = 0, physical = 0;
+	for (int i = 0; i < mg->ngaps; ++i) {
+		size_t n = mg->gap[i].offs - logical;
+		memmove(mg->text + logical, mg->text + physical, n);
+		logical += n;
+		physical += n + mg->gap[i].size;
+	}
+
+	memmove(mg->text + logical, mg->text + physical, mg->len - logical);
+
+	mg->size = mg->len + MGAP_GROW;
+	mg->text = realloc(mg->text, mg->size);
+	memmove(mg->text + pos + MGAP_GROW, mg->text + pos, mg->len - pos);
+
+	mg->ngaps = 0;
+	add_gap(mg, 0, pos, MGAP_GROW);
+}
+
+MultiGap *
+mgap_read(FILE *in)
+{
+	size_t len = 0, size = MGAP_GROW;
+	char *text = malloc(size);
+
+	for (;;) {
+		len += fread(text + len, 1, size - len, in);
+		if (ferror(in)) {
+			fprintf(stderr, "error reading buffer: fread() failed.\n");
+			free(text);
+			return NULL;
+		}
+
+		if (len < size)
+			break;
+
+		size *= 2;
+		text = realloc(text, size);
+	}
+
+	MultiGap *mg = malloc(sizeof(MultiGap));
+	mg->size = len + MGAP_GROW;
+	mg->text = realloc(text, mg->size);
+	mg->len = len;
+	mg->ngaps = 0;
+	add_gap(mg, 0, len, MGAP_GROW);
+	return mg;
+}
+
+void
+mgap_destroy(MultiGap *mg)
+{
+	free(mg->text);
+	free(mg);
+}
+
+void
+mgap_insert(MultiGap *mg, size_t pos, const char *str, size_t len)
+{
+	if (len == 0)
+		return;
+
+	int i = gap_at(mg, pos);
+	if (mg->gap[i].size < len) {
+		size_t room = mg->size / 2 > MGAP_GROW ? mg->size / 2 : MGAP_GROW;
+		grow_gap(mg, i, len - mg->gap[i].size + room);
+	}
+
+	memcpy(mg->text + gap_start(mg, i), str, len);
+	mg->gap[i].offs += len;
+	mg->gap[i].size -= len;
+	for (int j = i + 1; j < mg->ngaps; ++j)
+		mg->gap[j].offs += len;
+
+	mg->len += len;
+
+	if (!mg->gap[i].size)
+		remove_gap(mg, i);
+}
+
+void
+mgap_delete(MultiGap *mg, size_t pos, size_t len)
+{
+	if (pos >= mg->len)
+		return;
+
+	if (pos + len > mg->len)
+		len = mg->len - pos;
+
+	if (len == 0)
+		return;
+
+	int i = gap_at(mg, pos);
+	mg->len -= len;
+
+	/* the gap swallows the text after it; gaps within the deleted
+	 * text merge into it */
+	while (len) {
+		struct mgap *next = i + 1 < mg->ngaps ? &mg->gap[i + 1] : NULL;
+		size_t n = next && next->offs - pos < len ? next->offs - pos : len;
+
+		mg->gap[i].size += n;
+		for (int j = i + 1; j < mg->ngaps; ++j)
+			mg->gap[j].offs -= n;
+
+		if (next && next->offs == pos) {
+			mg->gap[i].size += next->size;
+			remove_gap(mg, i + 1);
+		}
+
+		len -= n;
+	}
+
+	/* give memory back once more than half of the buffer is gaps;
+	 * that took at least as many deleted bytes as compact() copies */
+	if (mg->size - mg->len > mg->len + MGAP_MAX * MGAP_GROW)
+		compact(mg, pos);
+}
+
+const char *
+mgap_get(MultiGap *mg, size_t pos, size_t *run)
+{
+	size_t p = pos;
+	int i;
+	for (i = 0; i < mg->ngaps && mg->gap[i].offs <= pos; ++i)
+		p += mg->gap[i].size;
+
+	if (run)
+		*run = (i < mg->ngaps ? mg->gap[i].offs : mg->len) - pos;
+	return mg->text + p;
+}
+
+const char *
+mgap_get_before(MultiGap *mg, size_t pos, size_t *run)
+{
+	size_t p = pos;
+	int i;
+	for (i = 0; i < mg->ngaps && mg->gap[i].offs < pos; ++i)
+		p += mg->gap[i].size;
+
+	*run = pos - (i > 0 ? mg->gap[i - 1].offs : 0);
+	return mg->text + p;
+}
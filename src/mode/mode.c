@@ -14,6 +14,14 @@ pop_mode(Buffer *buf)
 	buf->mode = mode->below;
 }
 
+/*
+ * Select mode, with the count typed before a command.
+ */
+struct select_mode {
+	Mode mode;
+	int count;
+};
+
 static void sm_destroy(Mode *mode);
 static void sm_on_key_press(Buffer *buf, Mode *mode, KeyMods mods, const char *input, size_t len);
 static void sm_on_enter_press(Buffer *buf, Mode *mode, KeyMods mods);
@@ -23,10 +31,14 @@ static void sm_on_delete_press(Buffer *buf, Mode *mode, KeyMods mods);
 void
 push_select_mode(Buffer *buf)
 {
-	Mode *mode = malloc(sizeof(Mode));
-	if (!mode)
+	struct select_mode *sm = malloc(sizeof(struct select_mode));
+	if (!sm)
 		return;
 
+	sm->count = 0;
+
+	Mode *mode = &sm->mode;
+
 	mode->on_key_press = sm_on_key_press;
 	mode->on_enter_press = sm_on_enter_press;
 	mode->on_backspace_press = sm_on_backspace_press;
@@ -42,7 +54,7 @@ push_select_mode(Buffer *buf)
 static void
 sm_destroy(Mode *mode)
 {
-	free(mode);
+	free((struct select_mode *)mode);
 }
 
 static void
@@ -81,6 +93,19 @@ sm_on_key_press(Buffer *buf, Mode *mode, KeyMods mods, const char *input, size_t
 	if (len != 1)
 		return;
 
+	/* digits make up the count for the next command */
+	struct select_mode *sm = (struct select_mode *)mode;
+	int prefix = sm->count;
+	sm->count = 0;
+
+	if (!(mods & KM_CONTROL) && input[0] >= '0' && input[0] <= '9') {
+		if (prefix < 100000)
+			sm->count = 10 * prefix + input[0] - '0';
+		return;
+	}
+
+	int count = prefix ? prefix : 1;
+
 	if (mods & KM_CONTROL) {
 		switch (input[0]) {
 		case 'd':
@@ -90,10 +115,16 @@ sm_on_key_press(Buffer *buf, Mode *mode, KeyMods mods, const char *input, size_t
 			buf_save(buf);
 			break;
 		case 'z':
-			buf_undo(buf);
+			if (count > 1)
+				buf_undo_steps(buf, count);
+			else
+				buf_undo(buf);
 			break;
 		case 'Z':
-			buf_dumb_redo(buf);
+			if (count > 1)
+				buf_redo_steps(buf, count);
+			else
+				buf_dumb_redo(buf);
 			break;
 		}
 
@@ -142,6 +173,14 @@ sm_on_key_press(Buffer *buf, Mode *mode, KeyMods mods, const char *input, size_t
 		select_prev_line(buf, input[0] == 'K');
 		break;
 
+	case 'C':
+		buf_add_selection_below(buf);
+		break;
+
+	case ',':
+		buf_clear_selections(buf);
+		break;
+
 	case '.':
 		buf->werk->active_buf = buf->prev;
 		break;
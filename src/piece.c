@@ -0,0 +1,341 @@
+#include <werk/piece.h>
+#include <werk/treap.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static size_t
+sub_len(Piece *p)
+{
+	return p ? p->sub_len : 0;
+}
+
+static Piece *
+piece_update(Piece *p)
+{
+	p->sub_len = sub_len(p->link[0]) + p->len + sub_len(p->link[1]);
+	return p;
+}
+
+static Piece *
+piece_create(bool add, size_t offs, size_t len)
+{
+	Piece *p = malloc(sizeof(Piece));
+	p->link[0] = p->link[1] = NULL;
+	p->prio = next_prio();
+	p->add = add;
+	p->offs = offs;
+	p->len = len;
+	return piece_update(p);
+}
+
+static void
+tree_free(Piece *p)
+{
+	if (!p)
+		return;
+
+	tree_free(p->link[0]);
+	tree_free(p->link[1]);
+	free(p);
+}
+
+static Piece *
+merge(Piece *a, Piece *b)
+{
+	if (!a)
+		return b;
+	if (!b)
+		return a;
+
+	if (a->prio > b->prio) {
+		a->link[1] = merge(a->link[1], b);
+		return piece_update(a);
+	}
+
+	b->link[0] = merge(a, b->link[0]);
+	return piece_update(b);
+}
+
+/*
+ * Split `p' so that `*a' contains the first `pos' bytes of text, and
+ * `*b' the rest. A piece is split in two if needed.
+ */
+static void
+split(Piece *p, size_t pos, Piece **a, Piece **b)
+{
+	if (!p) {
+		*a = *b = NULL;
+		return;
+	}
+
+	size_t left = sub_len(p->link[0]);
+
+	if (pos <= left) {
+		split(p->link[0], pos, a, &p->link[0]);
+		*b = piece_update(p);
+		return;
+	}
+
+	if (pos >= left + p->len) {
+		split(p->link[1], pos - left - p->len, &p->link[1], b);
+		*a = piece_update(p);
+		return;
+	}
+
+	size_t head = pos - left;
+	Piece *rest = piece_create(p->add, p->offs + head, p->len - head);
+	*b = merge(rest, p->link[1]);
+
+	p->link[1] = NULL;
+	p->len = head;
+	*a = piece_update(p);
+}
+
+/*
+ * Detach the last piece of `p', which is stored in `taken'. Returns the
+ * remaining tree.
+ */
+static Piece *
+take_last(Piece *p, Piece **taken)
+{
+	if (!p->link[1]) {
+		Piece *other = p->link[0];
+		p->link[0] = NULL;
+		*taken = piece_update(p);
+		return other;
+	}
+
+	p->link[1] = take_last(p->link[1], taken);
+	return piece_update(p);
+}
+
+PieceTable *
+ptab_open(FILE *in)
+{
+	struct stat st;
+	if (fstat(fileno(in), &st) < 0 || !S_ISREG(st.st_mode)) {
+		fprintf(stderr, "error reading buffer: not a regular file.\n");
+		return NULL;
+	}
+
+	PieceTable *pt = malloc(sizeof(PieceTable));
+	if (!pt)
+		return NULL;
+
+	memset(pt, 0, sizeof(*pt));
+
+	pt->orig_size = st.st_size;
+	if (pt->orig_size == 0)
+		return pt;
+
+	void *orig = mmap(NULL, pt->orig_size, PROT_READ, MAP_PRIVATE, fileno(in), 0);
+	if (orig == MAP_FAILED) {
+		fprintf(stderr, "error reading buffer: mmap() failed.\n");
+		free(pt);
+		return NULL;
+	}
+
+	/* pages are only read when touched; the first thing to touch
+	 * them is the line count, front to back */
+	madvise(orig, pt->orig_size, MADV_SEQUENTIAL);
+
+	pt->orig = orig;
+	pt->len = pt->orig_size;
+
+	pt->root = piece_create(false, 0, pt->orig_size);
+	return pt;
+}
+
+void
+ptab_destroy(PieceTable *pt)
+{
+	if (pt->orig)
+		munmap((void *)pt->orig, pt->orig_size);
+
+	free(pt->add);
+	tree_free(pt->root);
+	free(pt);
+}
+
+static const char *
+piece_data(PieceTable *pt, const Piece *p)
+{
+	return (p->add ? pt->add : pt->orig) + p->offs;
+}
+
+/*
+ * Piece containing `pos', which must be inside the text. Its logical
+ * offset is stored in `piece_pos'.
+ */
+static Piece *
+find_piece(PieceTable *pt, size_t pos, size_t *piece_pos)
+{
+	/* sequential access is by far the most common */
+	Piece *p = pt->hint;
+	if (p && pos >= pt->hint_pos && pos - pt->hint_pos < p->len) {
+		*piece_pos = pt->hint_pos;
+		return p;
+	}
+
+	p = pt->root;
+	size_t start = 0;
+	for (;;) {
+		size_t left = sub_len(p->link[0]);
+		if (pos < start + left) {
+			p = p->link[0];
+			continue;
+		}
+
+		start += left;
+		if (pos < start + p->len)
+			break;
+
+		start += p->len;
+		p = p->link[1];
+	}
+
+	pt->hint = p;
+	*piece_pos = pt->hint_pos = start;
+	return p;
+}
+
+static Piece *
+last_piece(Piece *p)
+{
+	while (p->link[1])
+		p = p->link[1];
+
+	return p;
+}
+
+/*
+ * Get `len' bytes of writable space at the end of the add buffer.
+ */
+static char *
+reserve(PieceTable *pt, size_t len)
+{
+	if (pt->add_len + len > pt->add_cap) {
+		size_t new_cap = pt->add_cap ? pt->add_cap : 4096;
+		while (new_cap < pt->add_len + len)
+			new_cap *= 2;
+
+		char *new_add = realloc(pt->add, new_cap);
+		if (!new_add)
+			return NULL;
+
+		pt->add = new_add;
+		pt->add_cap = new_cap;
+	}
+
+	return pt->add + pt->add_len;
+}
+
+/*
+ * Insert the first `len' bytes of the space returned by reserve() at
+ * `pos'.
+ */
+static void
+insert_reserved(PieceTable *pt, size_t pos, size_t len)
+{
+	if (len == 0)
+		return;
+
+	size_t offs = pt->add_len;
+	pt->add_len += len;
+	pt->len += len;
+
+	Piece *before, *after;
+	split(pt->root, pos, &before, &after);
+
+	/* typing appends to the piece before, instead of adding a new
+	 * piece per keystroke */
+	Piece *ins = NULL;
+	if (before)
+		before = take_last(before, &ins);
+
+	if (ins && ins->add && ins->offs + ins->len == offs) {
+		ins->len += len;
+		piece_update(ins);
+	} else {
+		before = merge(before, ins);
+		ins = piece_create(true, offs, len);
+	}
+
+	pt->hint = ins;
+	pt->hint_pos = pos + len - ins->len;
+	pt->root = merge(merge(before, ins), after);
+}
+
+void
+ptab_insert(PieceTable *pt, size_t pos, const char *str, size_t len)
+{
+	char *dest = reserve(pt, len);
+	if (!dest)
+		return;
+
+	memcpy(dest, str, len);
+	insert_reserved(pt, pos, len);
+}
+
+void
+ptab_delete(PieceTable *pt, size_t pos, size_t len)
+{
+	if (pos >= pt->len)
+		return;
+
+	if (pos + len > pt->len)
+		len = pt->len - pos;
+
+	if (len == 0)
+		return;
+
+	Piece *before, *deleted, *after;
+	split(pt->root, pos, &before, &after);
+	split(after, len, &deleted, &after);
+	tree_free(deleted);
+
+	/* backspacing goes on at the end of the piece before */
+	pt->hint = before ? last_piece(before) : NULL;
+	pt->hint_pos = pt->hint ? pos - pt->hint->len : 0;
+
+	pt->root = merge(before, after);
+	pt->len -= len;
+}
+
+const char *
+ptab_get(PieceTable *pt, size_t pos, size_t *run)
+{
+	if (pos >= pt->len) {
+		if (run)
+			*run = 0;
+		if (!pt->root)
+			return "";
+
+		Piece *last = last_piece(pt->root);
+		return piece_data(pt, last) + last->len;
+	}
+
+	size_t start;
+	Piece *p = find_piece(pt, pos, &start);
+	size_t skip = pos - start;
+	if (run)
+		*run = p->len - skip;
+
+	return piece_data(pt, p) + skip;
+}
+
+const char *
+ptab_get_before(PieceTable *pt, size_t pos, size_t *run)
+{
+	if (pos == 0) {
+		*run = 0;
+		return ptab_get(pt, pos, NULL);
+	}
+
+	size_t start;
+	Piece *p = find_piece(pt, pos - 1, &start);
+	*run = pos - start;
+	return piece_data(pt, p) + *run;
+}
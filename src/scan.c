@@ -0,0 +1,240 @@
+#include <werk/scan.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__)
+#define SCAN_X86
+#include <immintrin.h>
+#endif
+
+struct scanners {
+	size_t (*ascii)(const char *s, size_t len);
+	size_t (*printable)(const char *s, size_t len);
+	size_t (*newline)(const char *s, size_t len);
+};
+
+static const struct scanners *get_scanners(void);
+
+size_t
+scan_ascii(const char *s, size_t len)
+{
+	return get_scanners()->ascii(s, len);
+}
+
+size_t
+scan_printable(const char *s, size_t len)
+{
+	return get_scanners()->printable(s, len);
+}
+
+size_t
+scan_newline(const char *s, size_t len)
+{
+	return get_scanners()->newline(s, len);
+}
+
+/*
+ * Plain C versions, also used for the tails of the vectorized ones.
+ */
+
+static size_t
+ascii_c(const char *s, size_t len)
+{
+	size_t i = 0;
+
+	/* a word at a time */
+	for (; i + 8 <= len; i += 8) {
+		uint64_t w;
+		memcpy(&w, s + i, 8);
+		if (w & 0x8080808080808080ull)
+			break;
+	}
+
+	while (i < len && !(s[i] & 0x80))
+		++i;
+
+	return i;
+}
+
+static size_t
+printable_c(const char *s, size_t len)
+{
+	size_t i = 0;
+	while (i < len && s[i] >= 0x20 && s[i] < 0x7f)
+		++i;
+
+	return i;
+}
+
+static size_t
+newline_c(const char *s, size_t len)
+{
+	size_t i = 0;
+	for (; i < len; ++i) {
+		unsigned char ch = s[i];
+		if ((ch >= '\n' && ch <= '\r') || ch == 0xc2 || ch == 0xe2)
+			break;
+	}
+
+	return i;
+}
+
+static const struct scanners plain = { ascii_c, printable_c, newline_c };
+
+#ifdef SCAN_X86
+
+/*
+ * SSE2 is part of x86-64, so these always work there.
+ */
+
+static size_t
+ascii_sse2(const char *s, size_t len)
+{
+	size_t i = 0;
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+		unsigned mask = _mm_movemask_epi8(v);
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+
+	return i + ascii_c(s + i, len - i);
+}
+
+static size_t
+printable_sse2(const char *s, size_t len)
+{
+	const __m128i below = _mm_set1_epi8(0x1f);
+	const __m128i del = _mm_set1_epi8(0x7f);
+
+	size_t i = 0;
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+
+		/* signed compare, so this excludes non-ASCII as well */
+		__m128i ok = _mm_andnot_si128(_mm_cmpeq_epi8(v, del), _mm_cmpgt_epi8(v, below));
+		unsigned mask = _mm_movemask_epi8(ok);
+		if (mask != 0xffff)
+			return i + __builtin_ctz(~mask);
+	}
+
+	return i + printable_c(s + i, len - i);
+}
+
+static size_t
+newline_sse2(const char *s, size_t len)
+{
+	const __m128i lo = _mm_set1_epi8('\n' - 1);
+	const __m128i hi = _mm_set1_epi8('\r' + 1);
+	const __m128i nel = _mm_set1_epi8((char)0xc2);
+	const __m128i sep = _mm_set1_epi8((char)0xe2);
+
+	size_t i = 0;
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+		__m128i ctl = _mm_and_si128(_mm_cmpgt_epi8(v, lo), _mm_cmpgt_epi8(hi, v));
+		__m128i lead = _mm_or_si128(_mm_cmpeq_epi8(v, nel), _mm_cmpeq_epi8(v, sep));
+		unsigned mask = _mm_movemask_epi8(_mm_or_si128(ctl, lead));
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+
+	return i + newline_c(s + i, len - i);
+}
+
+static const struct scanners sse2 = { ascii_sse2, printable_sse2, newline_sse2 };
+
+/*
+ * The same with 32 bytes at a time, only used if the CPU has AVX2.
+ */
+
+__attribute__((target("avx2")))
+static size_t
+ascii_avx2(const char *s, size_t len)
+{
+	size_t i = 0;
+
+	/* text is mostly ASCII, so check two vectors at once and only
+	 * look closer when that fails */
+	for (; i + 64 <= len; i += 64) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)(s + i));
+		__m256i b = _mm256_loadu_si256((const __m256i *)(s + i + 32));
+		if (_mm256_movemask_epi8(_mm256_or_si256(a, b)))
+			break;
+	}
+
+	for (; i + 32 <= len; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+		unsigned mask = _mm256_movemask_epi8(v);
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+
+	return i + ascii_c(s + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static size_t
+printable_avx2(const char *s, size_t len)
+{
+	const __m256i below = _mm256_set1_epi8(0x1f);
+	const __m256i del = _mm256_set1_epi8(0x7f);
+
+	size_t i = 0;
+	for (; i + 32 <= len; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+		__m256i ok = _mm256_andnot_si256(_mm256_cmpeq_epi8(v, del), _mm256_cmpgt_epi8(v, below));
+		unsigned mask = _mm256_movemask_epi8(ok);
+		if (mask != 0xffffffffu)
+			return i + __builtin_ctz(~mask);
+	}
+
+	return i + printable_c(s + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static size_t
+newline_avx2(const char *s, size_t len)
+{
+	const __m256i lo = _mm256_set1_epi8('\n' - 1);
+	const __m256i hi = _mm256_set1_epi8('\r' + 1);
+	const __m256i nel = _mm256_set1_epi8((char)0xc2);
+	const __m256i sep = _mm256_set1_epi8((char)0xe2);
+
+	size_t i = 0;
+	for (; i + 32 <= len; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+		__m256i ctl = _mm256_and_si256(_mm256_cmpgt_epi8(v, lo), _mm256_cmpgt_epi8(hi, v));
+		__m256i lead = _mm256_or_si256(_mm256_cmpeq_epi8(v, nel), _mm256_cmpeq_epi8(v, sep));
+		unsigned mask = _mm256_movemask_epi8(_mm256_or_si256(ctl, lead));
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+
+	return i + newline_c(s + i, len - i);
+}
+
+static const struct scanners avx2 = { ascii_avx2, printable_avx2, newline_avx2 };
+
+#endif
+
+static const struct scanners *
+get_scanners(void)
+{
+	static const struct scanners *best;
+	if (best)
+		return best;
+
+	best = &plain;
+
+#ifdef SCAN_X86
+	best = &sse2;
+
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		best = &avx2;
+#endif
+
+	return best;
+}
@@ -27,6 +27,9 @@ typedef struct {
 	GtkWidget *window;
 	GtkWidget *darea;
 	GtkIMContext *im_ctx;
+
+	/* source of on_tick() */
+	guint tick;
 } WindowData;
 
 struct caret {
@@ -283,10 +286,23 @@ on_draw(GtkWidget *widget, cairo_t *cr, Window *window)
 static void
 on_destroy(GtkWidget *widget, Window *window)
 {
+	WindowData *wdata = window->data;
+	g_source_remove(wdata->tick);
+
 	if (window->on_close)
 		window->on_close(window);
 }
 
+static gboolean
+on_tick(gpointer data)
+{
+	Window *window = data;
+	if (window->on_tick)
+		window->on_tick(window);
+
+	return G_SOURCE_CONTINUE;
+}
+
 static void
 my_set_size(Window *win, int w, int h)
 {
@@ -375,6 +391,8 @@ gtk_spawner_ex(void)
 	g_signal_connect(window, "destroy", G_CALLBACK(on_destroy), result);
 	g_signal_connect(window, "destroy", G_CALLBACK(gtk_main_quit), window);
 
+	wdata->tick = g_timeout_add_seconds(1, on_tick, result);
+
 	gtk_window_set_default_size(GTK_WINDOW(window), 800, 600);
 	gtk_window_set_title(GTK_WINDOW(window), "werk");
 
@@ -1,18 +1,353 @@
 #include <werk/undo.h>
+#include <werk/treap.h>
+#include <werk/varint.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Least size of an arena chunk.
+ */
+#define UNDO_CHUNK_SIZE (64 * 1024)
+
+/*
+ * Block of arena memory. It is handed out from the end downward, so
+ * that the records of the present node, which were allocated last, can
+ * be extended in front.
+ */
+struct undo_chunk {
+	struct undo_chunk *prev;
+
+	char *data;
+	/* `data[0 .. free)' is still unused */
+	size_t free;
+};
+
+struct chunk_list {
+	/* newest chunk, linked to the older ones */
+	struct undo_chunk *chunk;
+	/* bytes in all chunks */
+	size_t size;
+};
+
+/*
+ * Nodes live as long as the tree. Records are kept apart, so that they
+ * can be compacted, or spilled to a file when they take more memory
+ * than the budget allows.
+ */
+struct undo_arena {
+	struct chunk_list nodes, records;
+
+	/* bytes of records to keep in memory, or 0 for no limit */
+	size_t budget;
+	/* records are collected once they take more memory than this;
+	 * at least half the budget is allocated in between, since each
+	 * collection walks the whole tree */
+	size_t limit;
+
+	/* append-only file with spilled records, opened on first use;
+	 * `spill_dead' of its bytes are copies of records that have
+	 * changed since, see compact_spill() */
+	FILE *spill;
+	long spill_end, spill_dead;
+	/* the spill file couldn't be opened or written; nothing is spilled
+	 * anymore */
+	bool spill_failed;
+
+	/* history file the tree was loaded from, see undo_tree_load() */
+	const unsigned char *map;
+	size_t map_size;
+
+	/* history file the tree was last saved to or loaded from, NULL if
+	 * none, and what is known of it: the nodes numbered in it, and the
+	 * bytes of it in use, see undo_tree_save() */
+	char *history;
+	dev_t history_dev;
+	ino_t history_ino;
+	size_t history_key_len;
+	uint64_t history_nodes, history_end;
+};
+
+/*
+ * History file, see undo_tree_save(). All numbers are 64-bit, in host
+ * byte order. The header is followed by the key, padded to a multiple
+ * of 8 bytes, then by entries up to `end': a `struct saved_node'
+ * followed by the records of the node, padded likewise.
+ *
+ * Nodes are numbered in the order of their first entry. A later entry
+ * for the same node replaces its records, which change whenever the
+ * node is undone or redone. The past of a node comes before it, and
+ * futures of the same node come oldest first.
+ *
+ * Saving appends entries for the nodes that are new or changed, and
+ * then writes the header. Until then, the file still describes the
+ * tree as it was last saved.
+ */
+static const char magic[8] = "werkund2";
+
+struct saved_header {
+	char magic[8];
+	uint64_t key_len;
+	uint64_t nodes;
+	/* node that is the past of the present */
+	uint64_t present_past;
+	/* bytes of the file in use */
+	uint64_t end;
+};
+
+struct saved_node {
+	int64_t index;
+	/* index of the past node, -1 for the root; only used by the first
+	 * entry of a node */
+	int64_t past;
+	int64_t from;
+	int64_t committed;
+	uint64_t size;
+};
+
+#define PAD8(n) (((n) + 7) & ~(size_t)7)
+
+/*
+ * A change, as decoded from its record.
+ */
+struct change {
+	long from;
+	size_t len;
+	/* deleted text, or NULL for an insertion */
+	const char *text;
+};
+
+/*
+ * Make sure the newest chunk has `size' bytes left.
+ */
+static void
+arena_reserve(struct chunk_list *l, size_t size)
+{
+	struct undo_chunk *c = l->chunk;
+	if (c && c->free >= size)
+		return;
+
+	size_t chunk_size = size > UNDO_CHUNK_SIZE ? size : UNDO_CHUNK_SIZE;
+
+	c = malloc(sizeof(struct undo_chunk));
+	c->data = malloc(chunk_size);
+	c->free = chunk_size;
+	c->prev = l->chunk;
+	l->chunk = c;
+	l->size += chunk_size;
+}
+
+/*
+ * Allocate `size' bytes, aligned to `align', which must be a power of
+ * two.
+ */
+static void *
+arena_alloc(struct chunk_list *l, size_t size, size_t align)
+{
+	arena_reserve(l, size + align - 1);
+
+	struct undo_chunk *c = l->chunk;
+	c->free = (c->free - size) & ~(align - 1);
+	return c->data + c->free;
+}
+
+static void
+arena_free(struct chunk_list *l)
+{
+	while (l->chunk) {
+		struct undo_chunk *c = l->chunk;
+		l->chunk = c->prev;
+		free(c->data);
+		free(c);
+	}
+
+	l->size = 0;
+}
+
+static UndoTree *
+node_alloc(UndoArena *a)
+{
+	UndoTree *node = arena_alloc(&a->nodes, sizeof(UndoTree), _Alignof(UndoTree));
+	memset(node, 0, sizeof(*node));
+	node->spilled_at = -1;
+	node->saved_as = -1;
+	node->arena = a;
+	return node;
+}
+
+static unsigned long
+zigzag(long v)
+{
+	return v < 0 ? ~((unsigned long)v << 1) : (unsigned long)v << 1;
+}
+
+static long
+unzigzag(unsigned long v)
+{
+	return v & 1 ? -(long)(v >> 1) - 1 : (long)(v >> 1);
+}
+
+/*
+ * Record tag: length of the change, and whether its text follows.
+ */
+static unsigned long
+record_tag(size_t len, bool has_text)
+{
+	return (unsigned long)len << 1 | has_text;
+}
+
+/*
+ * Decode the record at `p', of a change starting at `from', that must
+ * end before `end'. The start of the next record's change is stored in
+ * `next_from'. Returns the end of the record, or NULL if it doesn't fit.
+ */
+static const unsigned char *
+get_record(const unsigned char *p, const unsigned char *end, long from,
+           struct change *ch, long *next_from)
+{
+	unsigned long tag, delta;
+	p = varint_get(p, end, &tag);
+	if (p)
+		p = varint_get(p, end, &delta);
+	if (!p)
+		return NULL;
+
+	ch->from = from;
+	ch->len = tag >> 1;
+	ch->text = NULL;
+	if (tag & 1) {
+		if (ch->len > (size_t)(end - p))
+			return NULL;
+
+		ch->text = (const char *)p;
+		p += ch->len;
+	}
+
+	long d = unzigzag(delta);
+	if (d < 0 ? from > LONG_MAX + d : from < LONG_MIN + d)
+		return NULL;
+
+	*next_from = from - d;
+	return p;
+}
+
+/*
+ * Make room for `size' more bytes in front of the records of `node',
+ * which is being recorded. Returns the new start of the records.
+ */
+static unsigned char *
+grow_records(UndoArena *a, UndoTree *node, size_t size)
+{
+	if (!size)
+		return node->changes;
+
+	struct undo_chunk *c = a->records.chunk;
+	if (c && node->changes == (unsigned char *)c->data + c->free && c->free >= size) {
+		c->free -= size;
+	} else {
+		/* leave as much room again, so that this happens rarely */
+		arena_reserve(&a->records, 2 * (node->size + size));
+		unsigned char *moved = arena_alloc(&a->records, node->size + size, 1);
+		if (node->size)
+			memcpy(moved + size, node->changes, node->size);
+
+		node->changes = moved + size;
+		node->cap = node->size;
+	}
+
+	node->changes -= size;
+	node->size += size;
+	node->cap += size;
+	return node->changes;
+}
+
+/*
+ * Write a record in front of the records of `node', replacing the first
+ * `replace' bytes, the header of a record whose text the new text goes
+ * in front of.
+ */
+static void
+put_record(UndoTree *node, size_t replace, unsigned long tag, long delta, const char *text, size_t text_len)
+{
+	size_t tag_len = varint_len(tag);
+	size_t header = tag_len + varint_len(zigzag(delta));
+
+	/* the header may shrink by more than the text adds */
+	if (header + text_len < replace)
+		header = replace - text_len;
+
+	unsigned char *p = grow_records(node->arena, node, header + text_len - replace);
+	p = varint_put(p, tag, 0);
+	p = varint_put(p, zigzag(delta), header - tag_len);
+	if (text_len)
+		memcpy(p, text, text_len);
+}
+
+/*
+ * Merges the change into the first record if possible: typing adds
+ * text right after the last addition, and backspace deletes text right
+ * before the last deletion. Other changes that touch, such as those
+ * made by different cursors, don't describe a single range of text.
+ * Returns whether it merged.
+ */
+static bool
+merge_change(UndoTree *present, long from, long until, const char *text)
+{
+	if (!present->size)
+		return false;
+
+	const unsigned char *p = present->changes;
+	const unsigned char *end = present->changes + present->size;
+	unsigned long tag, delta;
+	p = varint_get(p, end, &tag);
+	if (p)
+		p = varint_get(p, end, &delta);
+	if (!p)
+		return false;
+
+	size_t header = p - present->changes;
+	size_t last_len = tag >> 1;
+	bool last_has_text = tag & 1;
+	long last_from = present->from;
+	size_t len = until - from;
+
+	if (text && last_has_text && until == last_from) {
+		put_record(present, header, record_tag(last_len + len, true),
+		           unzigzag(delta) - (long)len, text, len);
+		present->from = from;
+		return true;
+	}
+
+	if (!text && !last_has_text && last_from + (long)last_len == from) {
+		put_record(present, header, record_tag(last_len + len, false),
+		           unzigzag(delta), NULL, 0);
+		return true;
+	}
+
+	return false;
+}
 
 UndoTree *
-undo_tree_init(void)
+undo_tree_init(size_t budget)
 {
-	UndoTree *root = malloc(sizeof(UndoTree));
-	memset(root, 0, sizeof(*root));
+	UndoArena *a = malloc(sizeof(UndoArena));
+	memset(a, 0, sizeof(*a));
+	a->budget = budget;
+	a->limit = budget;
 
-	UndoTree *present = malloc(sizeof(UndoTree));
-	memset(present, 0, sizeof(*present));
+	UndoTree *root = node_alloc(a);
+
+	UndoTree *present = node_alloc(a);
 	present->past = root;
 	return present;
 }
@@ -20,82 +355,381 @@ undo_tree_init(void)
 void
 undo_tree_destroy(UndoTree *present)
 {
+	UndoArena *a = present->arena;
+	arena_free(&a->nodes);
+	arena_free(&a->records);
+
+	if (a->spill)
+		fclose(a->spill);
+	if (a->map)
+		munmap((void *)a->map, a->map_size);
+
+	free(a->history);
+	free(a);
+}
+
+static void
+record_change(UndoTree *present, long from, long until, const char *text)
+{
+	if (merge_change(present, from, until, text))
+		return;
+
+	size_t len = until - from;
+	put_record(present, 0, record_tag(len, text), from - present->from,
+	           text, text ? len : 0);
+	present->from = from;
 }
 
 void
-notify_add(UndoTree *present, ChangePos from, ChangePos until)
+notify_add(UndoTree *present, long from, long until)
 {
-	notify_delete(present, from, until, NULL);
+	record_change(present, from, until, NULL);
+}
+
+void
+notify_delete(UndoTree *present, long from, long until, const char *text)
+{
+	record_change(present, from, until, text);
 }
 
 /*
- * Merges changes if possible (to aid memory consumption)
- * Very simplistic... Will get around to updating once the ChangePos system
- * becomes less complicated (it ought to be simply an offset, really)
+ * Append the records of `node' to the spill file. They stay in memory
+ * until the file is flushed, see collect(). Returns whether it worked.
  */
-static void
-undo_tree_add_change(UndoTree *present, Change *ch)
+static bool
+spill(UndoArena *a, UndoTree *node)
+{
+	if (a->spill_failed)
+		return false;
+
+	if (!a->spill) {
+		a->spill = tmpfile();
+		if (!a->spill) {
+			fprintf(stderr, "error spilling undo history: tmpfile() failed.\n");
+			a->spill_failed = true;
+			return false;
+		}
+	}
+
+	if (fwrite(node->changes, 1, node->size, a->spill) != node->size) {
+		fprintf(stderr, "error spilling undo history: fwrite() failed.\n");
+		a->spill_failed = true;
+		return false;
+	}
+
+	node->spilled_at = a->spill_end;
+	a->spill_end += node->size;
+	return true;
+}
+
+/*
+ * Copy the spilled records of `node' to `dest'. Returns whether it
+ * worked.
+ */
+static bool
+read_spilled(UndoArena *a, UndoTree *node, unsigned char *dest)
 {
-	Change *last = present->changes;
-	if (!last)
-		goto simple;
+	size_t done = 0;
+	while (done < node->size) {
+		ssize_t n = pread(fileno(a->spill), dest + done, node->size - done,
+		                  node->spilled_at + done);
+		if (n <= 0) {
+			fprintf(stderr, "error reading undo history: pread() failed.\n");
+			return false;
+		}
+
+		done += n;
+	}
+
+	return true;
+}
+
+/*
+ * Read the spilled records of `node' back into memory. Returns whether
+ * it worked.
+ */
+static bool
+page_in(UndoArena *a, UndoTree *node)
+{
+	unsigned char *changes = arena_alloc(&a->records, node->size, 1);
+	if (!read_spilled(a, node, changes))
+		return false;
+
+	node->changes = changes;
+	node->cap = node->size;
+	return true;
+}
 
-	bool ch_has_text = ch->text;
-	bool last_has_text = last->text;
+/*
+ * Whether the records of `node' decode to changes that lie within the
+ * records and at offsets that can be in a text.
+ */
+static bool
+records_valid(UndoTree *node)
+{
+	const unsigned char *p = node->changes;
+	const unsigned char *end = node->changes + node->size;
 
-	if (ch_has_text != last_has_text)
-		goto simple;
+	struct change ch;
+	long from = node->from;
+	while (p < end) {
+		if (from < 0)
+			return false;
 
-	if (ch->until.offset == last->from.offset) {
-		present->changes = ch;
-		ch->next = last->next;
-		last->next = NULL;
+		long next_from;
+		p = get_record(p, end, from, &ch, &next_from);
+		if (!p || ch.len > (size_t)(LONG_MAX - from))
+			return false;
 
-		Change *temp = last;
-		last = ch;
-		ch = temp;
+		from = next_from;
 	}
 
-	if (last->until.offset == ch->from.offset) {
-		if (ch_has_text) {
-			size_t last_size = last->until.offset - last->from.offset;
-			size_t ch_size = ch->until.offset - ch->from.offset;
-			char *merged = malloc(last_size + ch_size);
-			memcpy(merged, last->text, last_size);
-			memcpy(merged + last_size, ch->text, ch_size);
-			free((char *)last->text);
-			free((char *)ch->text);
-			ch->text = merged;
+	return true;
+}
+
+/*
+ * Whether the changes of `node' can be made, in order, to a text of
+ * `*text_len' bytes, which becomes the length after them.
+ */
+static bool
+changes_fit(UndoTree *node, size_t *text_len)
+{
+	const unsigned char *p = node->changes;
+	const unsigned char *end = node->changes + node->size;
+
+	struct change ch;
+	long from = node->from;
+	while (p < end) {
+		p = get_record(p, end, from, &ch, &from);
+		if (ch.from < 0 || (size_t)ch.from > *text_len)
+			return false;
+
+		/* records with text undo a deletion */
+		if (ch.text) {
+			*text_len += ch.len;
+		} else if (ch.len <= *text_len - ch.from) {
+			*text_len -= ch.len;
+		} else {
+			return false;
 		}
+	}
+
+	return true;
+}
 
-		ch->from = last->from;
-		ch->next = last->next;
-		present->changes = ch;
-		free(last);
+/*
+ * Make the records of `node' available to undo or redo it: read them
+ * back if they were spilled, and check them if they are still in the
+ * history file the tree was loaded from, which may have been corrupted
+ * since it was written. Then check that its changes fit in a text of
+ * `*text_len' bytes, which becomes the length after them. Returns
+ * whether the node can be used; if not, nothing should be changed.
+ */
+static bool
+records_ready(UndoArena *a, UndoTree *node, size_t *text_len)
+{
+	if (!node->changes && !page_in(a, node))
+		return false;
+
+	if (node->cap < node->size && !records_valid(node)) {
+		fprintf(stderr, "error reading undo history: corrupt records.\n");
+		return false;
+	}
+
+	if (!changes_fit(node, text_len)) {
+		fprintf(stderr, "error reading undo history: changes outside the text.\n");
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Queue of nodes for a breadth-first walk through the tree, each with
+ * the neighbour it was reached from.
+ */
+struct visit {
+	UndoTree *node, *from;
+};
+
+struct visits {
+	struct visit *queue;
+	size_t len, size;
+};
+
+static void
+visit(struct visits *v, UndoTree *node, UndoTree *from)
+{
+	if (v->len == v->size) {
+		v->size = v->size ? 2 * v->size : 64;
+		v->queue = realloc(v->queue, v->size * sizeof(*v->queue));
+	}
+
+	v->queue[v->len].node = node;
+	v->queue[v->len++].from = from;
+}
+
+/*
+ * Copy the records that are still spilled to a new spill file, leaving
+ * the stale ones behind. `v' holds all nodes of the tree. The old file
+ * is kept if anything fails.
+ */
+static void
+compact_spill(UndoArena *a, struct visits *v)
+{
+	FILE *out = tmpfile();
+	if (!out)
 		return;
+
+	long *moved = malloc(v->len * sizeof(long));
+	unsigned char *buf = NULL;
+	size_t buf_size = 0;
+	long end = 0;
+	bool ok = true;
+
+	for (size_t i = 0; ok && i < v->len; ++i) {
+		UndoTree *node = v->queue[i].node;
+		moved[i] = -1;
+		if (node->spilled_at < 0)
+			continue;
+
+		if (node->size > buf_size) {
+			buf_size = node->size;
+			buf = realloc(buf, buf_size);
+		}
+
+		ok = read_spilled(a, node, buf)
+		  && fwrite(buf, 1, node->size, out) == node->size;
+		moved[i] = end;
+		end += node->size;
 	}
 
-simple:
-	present->changes = ch;
-	ch->next = last;
+	if (ok && !fflush(out)) {
+		for (size_t i = 0; i < v->len; ++i)
+			v->queue[i].node->spilled_at = moved[i];
+
+		fclose(a->spill);
+		a->spill = out;
+		a->spill_end = end;
+		a->spill_dead = 0;
+	} else {
+		fclose(out);
+	}
+
+	free(buf);
+	free(moved);
 }
 
-void
-notify_delete(UndoTree *present, ChangePos from, ChangePos until, const char *text)
+/*
+ * Bring the records in memory back under half the budget. Nodes are
+ * visited from `present' outward, so the changes closest to being
+ * undone or redone stay in memory, and the rest is spilled in the
+ * order it will be needed, to be read back sequentially. The records
+ * that stay are copied into new chunks, which also gets rid of those
+ * left behind by undo and redo. Records in the history file the tree
+ * was loaded from have no room of their own (`cap' is 0), and stay
+ * there.
+ *
+ * Records that were read back and haven't changed since still have
+ * their copy in the spill file, and are just forgotten again. Records
+ * spilled by this pass are only forgotten once the spill file is
+ * flushed. If writing fails, they are kept after all, and nothing is
+ * spilled from then on.
+ */
+static void
+collect(UndoArena *a, UndoTree *present)
 {
-	Change *ch = malloc(sizeof(Change));
-	memset(ch, 0, sizeof(*ch));
+	struct visits v = { NULL, 0, 0 };
+	visit(&v, present, NULL);
 
-	ch->from = from;
-	ch->until = until;
+	struct chunk_list kept = { NULL, 0 };
+	size_t kept_size = 0;
+
+	UndoTree **spilled = NULL;
+	size_t nspilled = 0, spilled_size = 0;
+	long spill_start = a->spill_end;
+
+	for (size_t i = 0; i < v.len; ++i) {
+		UndoTree *node = v.queue[i].node;
+		UndoTree *from = v.queue[i].from;
+
+		bool over = kept_size + node->size > a->budget / 2;
+		bool mapped = node->cap < node->size;
+		if (!node->changes || mapped) {
+			/* nothing to do */
+		} else if (over && node != present && node->spilled_at >= 0) {
+			node->changes = NULL;
+			node->cap = 0;
+		} else if (over && node != present && spill(a, node)) {
+			if (nspilled == spilled_size) {
+				spilled_size = spilled_size ? 2 * spilled_size : 64;
+				spilled = realloc(spilled, spilled_size * sizeof(UndoTree *));
+			}
+
+			spilled[nspilled++] = node;
+		} else {
+			unsigned char *changes = arena_alloc(&kept, node->size, 1);
+			memcpy(changes, node->changes, node->size);
+			node->changes = changes;
+			node->cap = node->size;
+			kept_size += node->size;
+		}
 
-	if (text) {
-		size_t size = until.offset - from.offset;
-		ch->text = malloc(size);
-		memcpy((char *)ch->text, text, size);
+		if (node->past && node->past != from)
+			visit(&v, node->past, node);
+
+		for (UndoTree *fut = node->futures; fut; fut = fut->next_future) {
+			if (fut != from)
+				visit(&v, fut, node);
+		}
+	}
+
+	if (nspilled && !a->spill_failed && fflush(a->spill)) {
+		fprintf(stderr, "error spilling undo history: fflush() failed.\n");
+		a->spill_failed = true;
+	}
+
+	for (size_t i = 0; i < nspilled; ++i) {
+		UndoTree *node = spilled[i];
+		if (a->spill_failed) {
+			unsigned char *changes = arena_alloc(&kept, node->size, 1);
+			memcpy(changes, node->changes, node->size);
+			node->changes = changes;
+			node->cap = node->size;
+			node->spilled_at = -1;
+		} else {
+			node->changes = NULL;
+			node->cap = 0;
+		}
+	}
+
+	/* the records written by this pass may be incomplete; those of
+	 * earlier passes are still good */
+	if (a->spill_failed && a->spill) {
+		clearerr(a->spill);
+		fseek(a->spill, spill_start, SEEK_SET);
+		a->spill_end = spill_start;
 	}
 
-	undo_tree_add_change(present, ch);
+	if (a->spill && !a->spill_failed && a->spill_dead > a->spill_end - a->spill_dead)
+		compact_spill(a, &v);
+
+	arena_free(&a->records);
+	a->records = kept;
+	free(spilled);
+	free(v.queue);
+
+	a->limit = a->records.size + a->budget / 2;
+	if (a->limit < a->budget)
+		a->limit = a->budget;
+}
+
+static void
+maybe_collect(UndoTree *present)
+{
+	UndoArena *a = present->arena;
+	if (a->budget && a->records.size > a->limit)
+		collect(a, present);
 }
 
 void
@@ -103,11 +737,10 @@ commit(UndoTree **present)
 {
 	UndoTree *prev_pres = *present;
 
-	if (!prev_pres->changes)
+	if (!prev_pres->size)
 		return;
 
-	UndoTree *new_pres = malloc(sizeof(UndoTree));
-	memset(new_pres, 0, sizeof(*new_pres));
+	UndoTree *new_pres = node_alloc(prev_pres->arena);
 	new_pres->past = prev_pres;
 
 	UndoTree *past = prev_pres->past;
@@ -115,63 +748,118 @@ commit(UndoTree **present)
 
 	prev_pres->next_future = past->futures;
 	past->futures = prev_pres;
+	prev_pres->committed = time(NULL);
 
 	*present = new_pres;
+	maybe_collect(new_pres);
 }
 
 /*
- * Returns list of Changes required to un-exec
+ * Execute the changes of `node', and replace them by the changes
+ * required to un-exec them
  */
-static Change *
-exec_changes(Change *changes, text_adder adder, text_deleter deleter, void *udata)
+static void
+exec_changes(UndoTree *node, text_adder adder, text_deleter deleter, void *udata)
 {
-	Change *result = NULL;
+	/* the records are replaced, so a copy in the spill file is stale,
+	 * and so is the one in the history file */
+	if (node->spilled_at >= 0) {
+		node->arena->spill_dead += node->size;
+		node->spilled_at = -1;
+	}
 
-	while (changes) {
-		Change *next = changes->next;
-		changes->next = NULL;
+	node->saved = false;
 
-		ChangePos from = changes->from;
-		ChangePos until = changes->until;
+	size_t n = 0;
+	const unsigned char *p = node->changes;
+	const unsigned char *end = node->changes + node->size;
 
-		if (changes->text) {
-			adder(from, until, changes->text, udata);
-			free((char *)changes->text);
-			changes->text = NULL;
-		} else {
-			char *new_text = malloc(until.offset - from.offset);
-			deleter(from, until, new_text, udata);
-			changes->text = new_text;
-		}
+	struct change ch;
+	long from = node->from;
+	while (p < end) {
+		p = get_record(p, end, from, &ch, &from);
+		++n;
+	}
 
-		changes->next = result;
-		result = changes;
+	struct change *changes = malloc(n * sizeof(struct change));
+	p = node->changes;
+	from = node->from;
+	for (size_t i = 0; i < n; ++i)
+		p = get_record(p, end, from, &changes[i], &from);
 
-		changes = next;
+	/* the inverse changes are executed in reverse order; each one is
+	 * relative to the one executed before it */
+	size_t size = 0;
+	for (size_t i = 0; i < n; ++i) {
+		long prev_from = i ? changes[i - 1].from : 0;
+		size += varint_len(record_tag(changes[i].len, !changes[i].text));
+		size += varint_len(zigzag(changes[i].from - prev_from));
+		if (!changes[i].text)
+			size += changes[i].len;
 	}
 
-	return result;
+	unsigned char *inverse = malloc(size);
+	unsigned char *front = inverse + size;
+	for (size_t i = 0; i < n; ++i) {
+		long prev_from = i ? changes[i - 1].from : 0;
+		unsigned long tag = record_tag(changes[i].len, !changes[i].text);
+		unsigned long delta = zigzag(changes[i].from - prev_from);
+
+		front -= varint_len(tag) + varint_len(delta);
+		if (!changes[i].text)
+			front -= changes[i].len;
+
+		unsigned char *q = varint_put(front, tag, 0);
+		q = varint_put(q, delta, 0);
+
+		if (changes[i].text)
+			adder(changes[i].from, changes[i].text, changes[i].len, udata);
+		else
+			deleter(changes[i].from, changes[i].len, (char *)q, udata);
+	}
+
+	/* the node keeps its memory, unless the inverse doesn't fit */
+	unsigned char *dest;
+	if (size <= node->cap) {
+		dest = node->changes + node->size - size;
+	} else {
+		dest = arena_alloc(&node->arena->records, size, 1);
+		node->cap = size;
+	}
+
+	memcpy(dest, inverse, size);
+	node->changes = dest;
+	node->size = size;
+	node->from = n ? changes[n - 1].from : 0;
+
+	free(inverse);
+	free(changes);
 }
 
 void
-undo(UndoTree *present, text_adder adder, text_deleter deleter, void *udata)
+undo(UndoTree *present, size_t text_len, text_adder adder, text_deleter deleter, void *udata)
 {
-	assert(present->changes == NULL);
+	assert(present->size == 0);
 
 	UndoTree *to_undo = present->past;
 	assert(to_undo != NULL);
 
 	/* Detect root node */
-	if (!to_undo->changes)
+	if (!to_undo->size)
+		return;
+
+	if (!records_ready(present->arena, to_undo, &text_len))
 		return;
 
 	/* The undo node becomes a redo node */
-	to_undo->changes = exec_changes(to_undo->changes, adder, deleter, udata);
+	exec_changes(to_undo, adder, deleter, udata);
 	present->past = to_undo->past;
+	maybe_collect(present);
 }
 
 void
-redo(UndoTree *present, UndoTree *go_here, text_adder adder, text_deleter deleter, void *udata)
+redo(UndoTree *present, UndoTree *go_here, size_t text_len,
+     text_adder adder, text_deleter deleter, void *udata)
 {
 	UndoTree *go_here_parent = present->past;
 	assert(go_here_parent != NULL);
@@ -186,6 +874,658 @@ redo(UndoTree *present, UndoTree *go_here, text_adder adder, text_deleter delete
 
 	assert(is_valid_go_here);
 
-	go_here->changes = exec_changes(go_here->changes, adder, deleter, udata);
+	if (!records_ready(present->arena, go_here, &text_len))
+		return;
+
+	exec_changes(go_here, adder, deleter, udata);
 	present->past = go_here;
+	maybe_collect(present);
+}
+
+/*
+ * Piece of the document as it will be after a jump through history:
+ * either text of the document as it is now, or text from the pool.
+ * Pieces are kept in document order in a balanced tree (treap), so
+ * that a change made anywhere takes logarithmic time.
+ */
+struct piece {
+	struct piece *link[2];
+	unsigned prio;
+
+	bool literal;
+	/* offset in the document, or in the pool */
+	long src;
+	size_t len;
+	/* the same, but including both subtrees */
+	size_t sub_len;
+};
+
+/*
+ * Target document of a jump, in terms of the present document. The
+ * changes of all nodes on the way are made to the pieces, and the
+ * document itself only changes once, by the difference in the end.
+ */
+struct composer {
+	struct piece *root;
+	size_t npieces;
+	/* unused pieces, linked through link[0] */
+	struct piece *unused;
+
+	/* text added on the way */
+	char *pool;
+	size_t pool_len, pool_size;
+
+	text_reader reader;
+	void *udata;
+};
+
+static size_t
+sub_len(struct piece *p)
+{
+	return p ? p->sub_len : 0;
+}
+
+static struct piece *
+piece_update(struct piece *p)
+{
+	p->sub_len = sub_len(p->link[0]) + p->len + sub_len(p->link[1]);
+	return p;
+}
+
+static struct piece *
+piece_create(struct composer *c, bool literal, long src, size_t len)
+{
+	struct piece *p = c->unused;
+	if (p)
+		c->unused = p->link[0];
+	else
+		p = malloc(sizeof(struct piece));
+
+	p->link[0] = p->link[1] = NULL;
+	p->prio = next_prio();
+	p->literal = literal;
+	p->src = src;
+	p->len = len;
+	++c->npieces;
+	return piece_update(p);
+}
+
+static void
+piece_free(struct composer *c, struct piece *p)
+{
+	p->link[0] = c->unused;
+	c->unused = p;
+	--c->npieces;
+}
+
+static struct piece *
+merge_pieces(struct piece *a, struct piece *b)
+{
+	if (!a)
+		return b;
+	if (!b)
+		return a;
+
+	if (a->prio > b->prio) {
+		a->link[1] = merge_pieces(a->link[1], b);
+		return piece_update(a);
+	}
+
+	b->link[0] = merge_pieces(a, b->link[0]);
+	return piece_update(b);
+}
+
+/*
+ * Split `p' so that `*a' contains the first `offset' bytes of the
+ * document, and `*b' the rest. A piece is split in two if needed.
+ */
+static void
+split_pieces(struct composer *c, struct piece *p, size_t offset, struct piece **a, struct piece **b)
+{
+	if (!p) {
+		*a = *b = NULL;
+		return;
+	}
+
+	size_t left = sub_len(p->link[0]);
+
+	if (offset <= left) {
+		split_pieces(c, p->link[0], offset, a, &p->link[0]);
+		*b = piece_update(p);
+		return;
+	}
+
+	if (offset >= left + p->len) {
+		split_pieces(c, p->link[1], offset - left - p->len, &p->link[1], b);
+		*a = piece_update(p);
+		return;
+	}
+
+	size_t head = offset - left;
+	struct piece *rest = piece_create(c, p->literal, p->src + head, p->len - head);
+	*b = merge_pieces(rest, p->link[1]);
+
+	p->link[1] = NULL;
+	p->len = head;
+	*a = piece_update(p);
+}
+
+static void
+compose_add(long offset, const char *text, size_t len, void *udata)
+{
+	struct composer *c = udata;
+
+	if (c->pool_len + len > c->pool_size) {
+		while (c->pool_len + len > c->pool_size)
+			c->pool_size *= 2;
+		c->pool = realloc(c->pool, c->pool_size);
+	}
+
+	memcpy(c->pool + c->pool_len, text, len);
+	struct piece *p = piece_create(c, true, c->pool_len, len);
+	c->pool_len += len;
+
+	struct piece *before, *after;
+	split_pieces(c, c->root, offset, &before, &after);
+	c->root = merge_pieces(merge_pieces(before, p), after);
+}
+
+/*
+ * Copy the text of the pieces of `p' to `*copy_here', advancing it, and
+ * free them.
+ */
+static void
+take_pieces(struct composer *c, struct piece *p, char **copy_here)
+{
+	if (!p)
+		return;
+
+	take_pieces(c, p->link[0], copy_here);
+
+	if (p->literal)
+		memcpy(*copy_here, c->pool + p->src, p->len);
+	else
+		c->reader(p->src, p->len, *copy_here, c->udata);
+	*copy_here += p->len;
+
+	take_pieces(c, p->link[1], copy_here);
+	piece_free(c, p);
+}
+
+static void
+compose_delete(long offset, size_t len, char *copy_here, void *udata)
+{
+	struct composer *c = udata;
+
+	struct piece *before, *deleted, *after;
+	split_pieces(c, c->root, offset, &before, &after);
+	split_pieces(c, after, len, &deleted, &after);
+
+	take_pieces(c, deleted, &copy_here);
+	c->root = merge_pieces(before, after);
+}
+
+/*
+ * Store the pieces of `p' at `*out' in document order, advancing it.
+ */
+static void
+list_pieces(struct piece *p, struct piece ***out)
+{
+	if (!p)
+		return;
+
+	list_pieces(p->link[0], out);
+	*(*out)++ = p;
+	list_pieces(p->link[1], out);
+}
+
+static void
+free_pieces(struct piece *p)
+{
+	if (!p)
+		return;
+
+	free_pieces(p->link[0]);
+	free_pieces(p->link[1]);
+	free(p);
+}
+
+/*
+ * Make the present document into the target one, from the end back, so
+ * that offsets of the present document stay valid.
+ */
+static void
+apply_pieces(struct composer *c, text_adder adder, text_deleter deleter, void *udata)
+{
+	struct piece **pieces = malloc(c->npieces * sizeof(struct piece *));
+	struct piece **end = pieces;
+	list_pieces(c->root, &end);
+
+	/* start of the text kept after the pieces looked at so far,
+	 * and the first of those pieces that keeps text */
+	long kept = LONG_MAX;
+	size_t next = c->npieces;
+
+	for (size_t i = c->npieces; i-- > 0; ) {
+		struct piece *p = pieces[i];
+		if (p->literal)
+			continue;
+
+		/* what lies in between is deleted, or added */
+		long at = p->src + p->len;
+		if (at < kept)
+			deleter(at, kept - at, NULL, udata);
+		for (size_t k = next; k-- > i + 1; )
+			adder(at, c->pool + pieces[k]->src, pieces[k]->len, udata);
+
+		kept = p->src;
+		next = i;
+	}
+
+	if (kept > 0)
+		deleter(0, kept, NULL, udata);
+	for (size_t k = next; k-- > 0; )
+		adder(0, c->pool + pieces[k]->src, pieces[k]->len, udata);
+
+	free(pieces);
+}
+
+UndoTree *
+undo_tree_at_time(UndoTree *present, time_t when)
+{
+	UndoTree *root = present;
+	while (root->past)
+		root = root->past;
+
+	/* the committed nodes in preorder, so that of nodes committed in
+	 * the same second, a later one wins over its past */
+	UndoTree *best = root, *node = root;
+	for (;;) {
+		if (node->committed <= when && node->committed >= best->committed)
+			best = node;
+
+		if (node->futures) {
+			node = node->futures;
+			continue;
+		}
+
+		while (node != root && !node->next_future)
+			node = node->past;
+		if (node == root)
+			break;
+
+		node = node->next_future;
+	}
+
+	return best;
+}
+
+static size_t
+depth(UndoTree *node)
+{
+	size_t d = 0;
+	for (; node->past; node = node->past)
+		++d;
+
+	return d;
+}
+
+void
+undo_tree_goto(UndoTree *present, UndoTree *target, size_t text_len,
+               text_adder adder, text_deleter deleter, text_reader reader, void *udata)
+{
+	assert(present->size == 0);
+
+	UndoTree *from = present->past;
+	if (from == target)
+		return;
+
+	/* nodes to undo up to the common past, then nodes to redo down
+	 * from there; the latter are found from the end */
+	size_t from_depth = depth(from), target_depth = depth(target);
+	size_t total = from_depth + target_depth;
+	UndoTree **path = malloc(total * sizeof(UndoTree *));
+	size_t nundo = 0, redo_start = total;
+
+	UndoTree *up = from, *down = target;
+	for (; from_depth > target_depth; --from_depth) {
+		path[nundo++] = up;
+		up = up->past;
+	}
+
+	for (; target_depth > from_depth; --target_depth) {
+		path[--redo_start] = down;
+		down = down->past;
+	}
+
+	while (up != down) {
+		path[nundo++] = up;
+		up = up->past;
+		path[--redo_start] = down;
+		down = down->past;
+	}
+
+	size_t nredo = total - redo_start;
+	memmove(path + nundo, path + redo_start, nredo * sizeof(UndoTree *));
+
+	/* nothing may change before all changes are known */
+	for (size_t i = 0; i < nundo + nredo; ++i) {
+		if (!records_ready(present->arena, path[i], &text_len)) {
+			free(path);
+			return;
+		}
+	}
+
+	struct composer c = {
+		.pool = malloc(256),
+		.pool_size = 256,
+		.reader = reader,
+		.udata = udata
+	};
+	c.root = piece_create(&c, false, 0, LONG_MAX);
+
+	for (size_t i = 0; i < nundo + nredo; ++i)
+		exec_changes(path[i], compose_add, compose_delete, &c);
+
+	apply_pieces(&c, adder, deleter, udata);
+
+	present->past = target;
+	maybe_collect(present);
+
+	free_pieces(c.root);
+	while (c.unused) {
+		struct piece *p = c.unused;
+		c.unused = p->link[0];
+		free(p);
+	}
+	free(c.pool);
+	free(path);
+}
+
+/*
+ * Nodes of the tree of `present' in the order they are saved in: each
+ * node after its past, futures of the same node oldest first.
+ */
+static struct visits
+history_order(UndoTree *present)
+{
+	UndoTree *root = present;
+	while (root->past)
+		root = root->past;
+
+	struct visits v = { NULL, 0, 0 };
+	visit(&v, root, NULL);
+	for (size_t i = 0; i < v.len; ++i) {
+		size_t first = v.len;
+		for (UndoTree *fut = v.queue[i].node->futures; fut; fut = fut->next_future)
+			visit(&v, fut, v.queue[i].node);
+
+		/* futures lists are newest first */
+		for (size_t j = first, k = v.len; j + 1 < k; ++j, --k) {
+			struct visit tmp = v.queue[j];
+			v.queue[j] = v.queue[k - 1];
+			v.queue[k - 1] = tmp;
+		}
+	}
+
+	return v;
+}
+
+static uint64_t
+entry_size(UndoTree *node)
+{
+	return sizeof(struct saved_node) + PAD8(node->size);
+}
+
+/*
+ * Write the entry of `node' to `out'. Spilled records are read back
+ * through `*buf', of `*buf_size' bytes. Returns whether it worked.
+ */
+static bool
+write_entry(UndoArena *a, FILE *out, UndoTree *node, unsigned char **buf, size_t *buf_size)
+{
+	struct saved_node sn = {
+		node->saved_as, node->past ? node->past->saved_as : -1,
+		node->from, node->committed, node->size
+	};
+
+	const unsigned char *records = node->changes;
+	if (!records && node->size) {
+		if (node->size > *buf_size) {
+			*buf_size = node->size;
+			*buf = realloc(*buf, *buf_size);
+		}
+
+		if (!read_spilled(a, node, *buf))
+			return false;
+
+		records = *buf;
+	}
+
+	static const char zeros[8];
+	size_t pad = PAD8(node->size) - node->size;
+	return fwrite(&sn, sizeof(sn), 1, out) == 1
+	    && (!node->size || fwrite(records, 1, node->size, out) == node->size)
+	    && fwrite(zeros, 1, pad, out) == pad;
+}
+
+int
+undo_tree_save(UndoTree *present, const char *path, const void *key, size_t key_len)
+{
+	if (present->size)
+		return -1;
+
+	UndoArena *a = present->arena;
+	struct visits v = history_order(present);
+
+	/* size of the file if the nodes that changed are appended, and
+	 * how much of it would still be in use; once more than half of it
+	 * is dead, the file is written anew */
+	uint64_t head = sizeof(struct saved_header) + PAD8(key_len);
+	uint64_t end = a->history_end, live = head;
+	for (size_t i = 0; i < v.len; ++i) {
+		UndoTree *node = v.queue[i].node;
+		live += entry_size(node);
+		if (!node->saved)
+			end += entry_size(node);
+	}
+
+	struct stat st;
+	FILE *out = NULL;
+	bool append = a->history && !strcmp(a->history, path)
+	           && a->history_key_len == key_len && end <= 2 * live
+	           && (out = fopen(path, "r+b"))
+	           && !fstat(fileno(out), &st)
+	           && st.st_dev == a->history_dev && st.st_ino == a->history_ino
+	           && (uint64_t)st.st_size >= a->history_end;
+
+	static const char suffix[] = ".new";
+	size_t path_len = strlen(path);
+	char tmp_name[path_len + sizeof(suffix)];
+	memcpy(tmp_name, path, path_len);
+	memcpy(tmp_name + path_len, suffix, sizeof(suffix));
+
+	if (!append) {
+		if (out)
+			fclose(out);
+
+		out = fopen(tmp_name, "wb");
+		if (!out || fstat(fileno(out), &st)) {
+			if (out)
+				fclose(out);
+			free(v.queue);
+			return -1;
+		}
+	}
+
+	/* numbers the nodes had, to go back to if saving fails */
+	int64_t *was = malloc(v.len * sizeof(int64_t));
+	uint64_t nodes = append ? a->history_nodes : 0;
+	for (size_t i = 0; i < v.len; ++i) {
+		UndoTree *node = v.queue[i].node;
+		was[i] = node->saved_as;
+		if (!append || node->saved_as < 0)
+			node->saved_as = nodes++;
+	}
+
+	unsigned char *buf = NULL;
+	size_t buf_size = 0;
+	bool ok = !fseek(out, append ? a->history_end : head, SEEK_SET);
+	for (size_t i = 0; ok && i < v.len; ++i) {
+		UndoTree *node = v.queue[i].node;
+		if (!append || !node->saved)
+			ok = write_entry(a, out, node, &buf, &buf_size);
+	}
+
+	long out_end = ftell(out);
+	struct saved_header h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, magic, sizeof(magic));
+	h.key_len = key_len;
+	h.nodes = nodes;
+	h.present_past = present->past->saved_as;
+	h.end = out_end;
+
+	static const char zeros[8];
+	ok = ok && out_end >= 0
+	  && !fseek(out, 0, SEEK_SET)
+	  && fwrite(&h, sizeof(h), 1, out) == 1
+	  && fwrite(key, 1, key_len, out) == key_len
+	  && fwrite(zeros, 1, PAD8(key_len) - key_len, out) == PAD8(key_len) - key_len;
+	ok = !(ferror(out) | fclose(out)) && ok;
+	if (ok && !append)
+		ok = !rename(tmp_name, path);
+
+	free(buf);
+
+	if (!ok) {
+		if (!append)
+			remove(tmp_name);
+		for (size_t i = 0; i < v.len; ++i)
+			v.queue[i].node->saved_as = was[i];
+
+		free(was);
+		free(v.queue);
+		return -1;
+	}
+
+	for (size_t i = 0; i < v.len; ++i)
+		v.queue[i].node->saved = true;
+
+	if (!a->history || strcmp(a->history, path)) {
+		free(a->history);
+		a->history = strdup(path);
+	}
+
+	a->history_dev = st.st_dev;
+	a->history_ino = st.st_ino;
+	a->history_key_len = key_len;
+	a->history_nodes = nodes;
+	a->history_end = out_end;
+
+	free(was);
+	free(v.queue);
+	return 0;
+}
+
+UndoTree *
+undo_tree_load(const char *path, const void *key, size_t key_len, size_t budget)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	struct stat st;
+	void *map = MAP_FAILED;
+	if (!fstat(fd, &st) && st.st_size >= (off_t)sizeof(struct saved_header))
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	/* only the entries are read now; records are paged in by the
+	 * system as they are undone or redone */
+	const unsigned char *data = map;
+	size_t size = st.st_size;
+	const struct saved_header *h = map;
+	uint64_t head = sizeof(*h) + PAD8(key_len);
+
+	bool valid = !memcmp(h->magic, magic, sizeof(magic))
+	          && h->key_len == key_len
+	          && head <= size
+	          && !memcmp(data + sizeof(*h), key, key_len)
+	          && h->end >= head && h->end <= size
+	          && h->nodes > 0
+	          && h->nodes <= (h->end - head) / sizeof(struct saved_node)
+	          && h->present_past < h->nodes;
+
+	if (!valid) {
+		munmap(map, size);
+		return NULL;
+	}
+
+	UndoTree *present = undo_tree_init(budget);
+	UndoArena *a = present->arena;
+	a->map = map;
+	a->map_size = size;
+
+	/* undo_tree_init() made a root already */
+	UndoTree **nodes = malloc(h->nodes * sizeof(UndoTree *));
+	uint64_t count = 0, at = head;
+	while (valid && at < h->end) {
+		const struct saved_node *sn = (const void *)(data + at);
+		valid = h->end - at >= sizeof(*sn)
+		     && sn->size <= h->end - at - sizeof(*sn)
+		     && sn->index >= 0 && (uint64_t)sn->index <= count
+		     && (uint64_t)sn->index < h->nodes;
+		if (!valid)
+			break;
+
+		UndoTree *node;
+		if ((uint64_t)sn->index < count) {
+			node = nodes[sn->index];
+		} else if (!count) {
+			valid = sn->past == -1;
+			node = nodes[count++] = present->past;
+		} else {
+			valid = sn->past >= 0 && (uint64_t)sn->past < count;
+			if (!valid)
+				break;
+
+			/* futures come oldest first */
+			node = nodes[count++] = node_alloc(a);
+			node->past = nodes[sn->past];
+			node->next_future = node->past->futures;
+			node->past->futures = node;
+		}
+
+		node->saved_as = sn->index;
+		node->saved = true;
+		node->from = sn->from;
+		node->committed = sn->committed;
+		node->size = sn->size;
+		node->changes = (unsigned char *)data + at + sizeof(*sn);
+		node->cap = 0;
+
+		at += sizeof(*sn) + PAD8(sn->size);
+	}
+
+	valid = valid && count == h->nodes && at == h->end;
+	if (valid)
+		present->past = nodes[h->present_past];
+
+	free(nodes);
+	if (!valid) {
+		undo_tree_destroy(present);
+		return NULL;
+	}
+
+	a->history = strdup(path);
+	a->history_dev = st.st_dev;
+	a->history_ino = st.st_ino;
+	a->history_key_len = key_len;
+	a->history_nodes = h->nodes;
+	a->history_end = h->end;
+	return present;
 }